@@ -0,0 +1,120 @@
+/*
+ *  Copyright (C) 2011 Quentin Stievenart <quentin.stievenart@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "ario-coverflow-albums.h"
+#include <config.h>
+
+#include "ario-debug.h"
+#include "servers/ario-server.h"
+
+/* Folded like the search index does: "É" and "e" are the same letter */
+static gint
+ario_coverflow_albums_letter (gunichar c)
+{
+        gchar buffer[6];
+        gchar *decomposed;
+
+        if (c >= 0x80) {
+                decomposed = g_utf8_normalize (buffer, g_unichar_to_utf8 (c, buffer),
+                                               G_NORMALIZE_NFD);
+                c = decomposed ? g_utf8_get_char (decomposed) : 0;
+                g_free (decomposed);
+        }
+
+        c = g_unichar_tolower (c);
+        if (c >= 'a' && c <= 'z')
+                return c - 'a';
+        return ARIO_COVERFLOW_N_LETTERS - 1;
+}
+
+ArioCoverflowAlbums *
+ario_coverflow_albums_new (void)
+{
+        ArioCoverflowAlbums *albums;
+        int i;
+
+        albums = g_new0 (ArioCoverflowAlbums, 1);
+        albums->array = g_array_new (FALSE, FALSE, sizeof (ArioCoverflowAlbum));
+        albums->positions = g_hash_table_new (g_direct_hash, g_direct_equal);
+        for (i = 0; i < ARIO_COVERFLOW_N_LETTERS; i++)
+                albums->letters[i] = -1;
+
+        return albums;
+}
+
+void
+ario_coverflow_albums_free (ArioCoverflowAlbums *albums)
+{
+        g_array_free (albums->array, TRUE);
+        g_hash_table_destroy (albums->positions);
+        g_free (albums);
+}
+
+const gchar *
+ario_coverflow_albums_make_key (const gchar *artist,
+                                const gchar *album)
+{
+        const gchar *key;
+        gchar *tmp;
+
+        tmp = g_strconcat (artist ? artist : "", "\t", album ? album : "", NULL);
+        key = g_intern_string (tmp);
+        g_free (tmp);
+
+        return key;
+}
+
+void
+ario_coverflow_albums_append_list (ArioCoverflowAlbums *albums,
+                                   GList *server_albums)
+{
+        ArioServerAlbum *server_album;
+        ArioCoverflowAlbum album;
+        GList *tmp;
+        gint letter;
+
+        for (tmp = server_albums; tmp; tmp = g_list_next (tmp)) {
+                server_album = tmp->data;
+                album.artist = g_intern_string (server_album->artist ? server_album->artist : "");
+                album.album = g_intern_string (server_album->album ? server_album->album : "");
+                album.key = ario_coverflow_albums_make_key (album.artist, album.album);
+
+                letter = ario_coverflow_albums_letter (g_utf8_get_char (album.artist));
+                if (albums->letters[letter] < 0)
+                        albums->letters[letter] = albums->array->len;
+
+                g_hash_table_insert (albums->positions, (gpointer) album.key,
+                                     GINT_TO_POINTER (albums->array->len + 1));
+                g_array_append_val (albums->array, album);
+        }
+}
+
+gint
+ario_coverflow_albums_find_letter (ArioCoverflowAlbums *albums,
+                                   gunichar c)
+{
+        return albums->letters[ario_coverflow_albums_letter (c)];
+}
+
+gint
+ario_coverflow_albums_find_key (ArioCoverflowAlbums *albums,
+                                const gchar *key)
+{
+        return GPOINTER_TO_INT (g_hash_table_lookup (albums->positions, key)) - 1;
+}
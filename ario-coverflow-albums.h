@@ -0,0 +1,70 @@
+/*
+ *  Copyright (C) 2011 - Quentin Stievenart <quentin.stievenart@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef __ARIO_COVERFLOW_ALBUMS_H
+#define __ARIO_COVERFLOW_ALBUMS_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* 'a' to 'z', then everything else */
+#define ARIO_COVERFLOW_N_LETTERS 27
+
+/* All the strings are interned, so records are compared by address */
+typedef struct
+{
+        const gchar *artist;
+        const gchar *album;
+        const gchar *key;
+} ArioCoverflowAlbum;
+
+typedef struct
+{
+        GArray *array;
+
+        /* Key -> index + 1 */
+        GHashTable *positions;
+
+        /* First album whose artist starts with each letter, or -1 */
+        gint letters[ARIO_COVERFLOW_N_LETTERS];
+} ArioCoverflowAlbums;
+
+#define ario_coverflow_albums_length(albums) ((gint) (albums)->array->len)
+#define ario_coverflow_albums_index(albums, i) (&g_array_index ((albums)->array, ArioCoverflowAlbum, (i)))
+
+ArioCoverflowAlbums *   ario_coverflow_albums_new               (void);
+
+void                    ario_coverflow_albums_free              (ArioCoverflowAlbums *albums);
+
+void                    ario_coverflow_albums_append_list       (ArioCoverflowAlbums *albums,
+                                                                 GList *server_albums);
+
+gint                    ario_coverflow_albums_find_letter       (ArioCoverflowAlbums *albums,
+                                                                 gunichar c);
+
+gint                    ario_coverflow_albums_find_key          (ArioCoverflowAlbums *albums,
+                                                                 const gchar *key);
+
+const gchar *           ario_coverflow_albums_make_key          (const gchar *artist,
+                                                                 const gchar *album);
+
+G_END_DECLS
+
+#endif /* __ARIO_COVERFLOW_ALBUMS_H */
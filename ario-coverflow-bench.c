@@ -0,0 +1,493 @@
+/*
+ *  Copyright (C) 2011 Quentin Stievenart <quentin.stievenart@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/* Headless benchmark of the coverflow: the plugin sources are built in
+ * this file, with the widget's GL plumbing replaced by an OSMesa
+ * context and the server by the fake one, over a synthetic library.
+ *
+ * GLEW looks the GL entry points up through GLX: Mesa's OSMesa and
+ * libGL must share their dispatch (libglapi) for the shader path to
+ * be measured, otherwise use --fixed. */
+
+#include <GL/glew.h>
+#include <GL/osmesa.h>
+#include <gtk/gtk.h>
+#include <gtk/gtkgl.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <config.h>
+
+#define ARIO_COVERFLOW_FAKE_SERVER
+#include "ario-coverflow-fake-server.h"
+#include "ario-coverflow.h"
+#include "ario-debug.h"
+#include "ario-util.h"
+#include "covers/ario-cover.h"
+#include "lib/ario-conf.h"
+#include "servers/ario-server.h"
+
+#define SETTLE_TIMEOUT 2000000 /* us to wait for a cover after a scroll */
+
+static const gchar *bench_config_dir (void);
+static gint bench_conf_get_integer (const gchar *key, gint default_value);
+static gboolean bench_conf_get_boolean (const gchar *key, gboolean default_value);
+static GLenum bench_glew_init (void);
+static void bench_get_allocation (GtkAllocation *allocation);
+static void bench_queue_draw (void);
+static void bench_swap_buffers (void);
+static gboolean bench_realized;
+
+/* Ario services, besides the server */
+#define ario_util_config_dir bench_config_dir
+#define ario_conf_get_integer bench_conf_get_integer
+#define ario_conf_get_boolean bench_conf_get_boolean
+#undef ARIO_TYPE_SOURCE
+#define ARIO_TYPE_SOURCE GTK_TYPE_HBOX
+#undef ARIO_LOG_DBG
+#define ARIO_LOG_DBG(...) ((void) 0)
+#undef ARIO_LOG_FUNCTION_START
+#define ARIO_LOG_FUNCTION_START
+
+/* The widget's GL plumbing: the OSMesa context is always current */
+#define glewInit bench_glew_init
+#define gtk_widget_get_gl_context(widget) ((GdkGLContext *) NULL)
+#define gtk_widget_get_gl_drawable(widget) ((GdkGLDrawable *) NULL)
+#define gdk_gl_drawable_gl_begin(drawable, context) ((void) (drawable), (void) (context), TRUE)
+#define gdk_gl_drawable_gl_end(drawable) ((void) (drawable))
+#define gdk_gl_drawable_is_double_buffered(drawable) ((void) (drawable), TRUE)
+#define gdk_gl_drawable_swap_buffers(drawable) ((void) (drawable), bench_swap_buffers ())
+#define gtk_widget_get_realized(widget) bench_realized
+#define gtk_widget_get_allocation(widget, allocation) bench_get_allocation (allocation)
+#define gtk_widget_queue_draw(widget) bench_queue_draw ()
+#define gtk_widget_grab_focus(widget) ((void) (widget))
+
+#include "ario-coverflow.c"
+#include "ario-coverflow-albums.c"
+#include "ario-coverflow-cache.c"
+#include "ario-coverflow-image.c"
+#include "ario-coverflow-loader.c"
+#include "ario-coverflow-pack.c"
+#include "ario-coverflow-paths.c"
+#include "ario-coverflow-pixels.c"
+#include "ario-coverflow-search.c"
+#include "ario-coverflow-stats.c"
+
+#undef glewInit
+
+static struct
+{
+        ArioCoverflowFakeServerParams library;
+        gint n_scrolls;
+        gint interval;          /* ms between scrolls */
+        gint burst;             /* wheel events per scroll */
+        gint n_appends;
+        gint n_rescanned;       /* albums replaced by a database update */
+        gint width, height;
+        gboolean fixed;
+        gdouble max_frame_p99;
+        gdouble max_latency_p99;
+        gchar **settings;
+        gchar *stats;           /* file the stage timings are written to */
+
+        gchar *dir;
+        GHashTable *conf;
+        gboolean redraw;
+        guint64 frames;
+} bench = {
+        ARIO_COVERFLOW_FAKE_SERVER_PARAMS_DEFAULT, 200, 100, 1, 20, 100, 800, 400, FALSE, 0, 0, NULL, NULL,
+        NULL, NULL, FALSE, 0
+};
+
+static const gchar *
+bench_config_dir (void)
+{
+        return bench.dir;
+}
+
+static gint
+bench_conf_get_integer (const gchar *key, gint default_value)
+{
+        const gchar *value = g_hash_table_lookup (bench.conf, key);
+
+        return value ? atoi (value) : default_value;
+}
+
+static gboolean
+bench_conf_get_boolean (const gchar *key, gboolean default_value)
+{
+        const gchar *value = g_hash_table_lookup (bench.conf, key);
+
+        return value ? (strcmp (value, "true") == 0 || atoi (value)) : default_value;
+}
+
+static GLenum
+bench_glew_init (void)
+{
+        GLenum code;
+
+        if (bench.fixed)
+                return GLEW_OK + 1;
+
+        /* Without a GLX display GLEW still loads the core entry points,
+         * it only fails on the GLX ones */
+        glewExperimental = GL_TRUE;
+        code = glewInit ();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+        if (code == GLEW_ERROR_NO_GLX_DISPLAY)
+                code = GLEW_OK;
+#endif
+        return code;
+}
+
+static void
+bench_get_allocation (GtkAllocation *allocation)
+{
+        allocation->x = 0;
+        allocation->y = 0;
+        allocation->width = bench.width;
+        allocation->height = bench.height;
+}
+
+static void
+bench_queue_draw (void)
+{
+        bench.redraw = TRUE;
+}
+
+static void
+bench_swap_buffers (void)
+{
+        /* Software rendering: the frame is done when glFinish returns */
+        glFinish ();
+        bench.frames++;
+}
+
+static gint
+compare_doubles (gconstpointer a, gconstpointer b)
+{
+        gdouble da = *(const gdouble *) a, db = *(const gdouble *) b;
+
+        return da < db ? -1 : da > db;
+}
+
+static gdouble
+percentile (GArray *samples, gdouble p)
+{
+        if (samples->len == 0)
+                return 0;
+
+        g_array_sort (samples, compare_doubles);
+        return g_array_index (samples, gdouble, (guint) (p * (samples->len - 1) + 0.5));
+}
+
+static void
+add_sample (GArray *samples, gint64 start, gint64 end)
+{
+        gdouble ms = (end - start) / 1000.0;
+
+        g_array_append_val (samples, ms);
+}
+
+static void
+report (const gchar *name, GArray *samples, const gchar *unit)
+{
+        g_print ("%-24s n=%-6u p50=%9.2f %s  p99=%9.2f %s\n", name, samples->len,
+                 percentile (samples, 0.5), unit, percentile (samples, 0.99), unit);
+}
+
+static void
+remove_tree (const gchar *path)
+{
+        const gchar *name;
+        gchar *child;
+        GDir *dir;
+
+        dir = g_dir_open (path, 0, NULL);
+        if (dir) {
+                while ((name = g_dir_read_name (dir))) {
+                        child = g_build_filename (path, name, NULL);
+                        remove_tree (child);
+                        g_free (child);
+                }
+                g_dir_close (dir);
+        }
+        g_remove (path);
+}
+
+/* Runs the main loop and draws when asked to, until the deadline */
+static void
+pump (ArioCoverflow *coverflow, gint64 deadline, GArray *frame_times)
+{
+        gint64 start;
+
+        while (g_get_monotonic_time () < deadline) {
+                while (g_main_context_iteration (NULL, FALSE));
+                if (bench.redraw) {
+                        bench.redraw = FALSE;
+                        start = g_get_monotonic_time ();
+                        draw (coverflow);
+                        if (frame_times)
+                                add_sample (frame_times, start, g_get_monotonic_time ());
+                } else {
+                        g_usleep (500);
+                }
+        }
+}
+
+int
+main (int argc, char **argv)
+{
+        GOptionEntry entries[] = {
+                { "albums", 0, 0, G_OPTION_ARG_INT, &bench.library.n_albums, "Number of albums", "N" },
+                { "albums-per-artist", 0, 0, G_OPTION_ARG_INT, &bench.library.albums_per_artist, "Most albums of one artist", "N" },
+                { "latency", 0, 0, G_OPTION_ARG_INT, &bench.library.latency, "Time the server takes to answer", "MS" },
+                { "missing", 0, 0, G_OPTION_ARG_INT, &bench.library.missing, "Albums without a cover", "PERCENT" },
+                { "covers", 0, 0, G_OPTION_ARG_INT, &bench.library.n_covers, "Distinct cover files", "N" },
+                { "scrolls", 0, 0, G_OPTION_ARG_INT, &bench.n_scrolls, "Number of scroll steps", "N" },
+                { "interval", 0, 0, G_OPTION_ARG_INT, &bench.interval, "Time between scroll steps", "MS" },
+                { "burst", 0, 0, G_OPTION_ARG_INT, &bench.burst, "Wheel events in each scroll step", "N" },
+                { "appends", 0, 0, G_OPTION_ARG_INT, &bench.n_appends, "Number of albums added to the playlist", "N" },
+                { "rescan", 0, 0, G_OPTION_ARG_INT, &bench.n_rescanned, "Albums replaced by a database update", "N" },
+                { "width", 0, 0, G_OPTION_ARG_INT, &bench.width, "Viewport width", "PX" },
+                { "height", 0, 0, G_OPTION_ARG_INT, &bench.height, "Viewport height", "PX" },
+                { "fixed", 0, 0, G_OPTION_ARG_NONE, &bench.fixed, "Use the fixed pipeline renderer", NULL },
+                { "stats", 0, 0, G_OPTION_ARG_FILENAME, &bench.stats, "Write the stage timings to a file", "FILE" },
+                { "set", 0, 0, G_OPTION_ARG_STRING_ARRAY, &bench.settings, "Set a preference", "KEY=VALUE" },
+                { "max-frame-p99", 0, 0, G_OPTION_ARG_DOUBLE, &bench.max_frame_p99, "Fail above this p99 frame time", "MS" },
+                { "max-latency-p99", 0, 0, G_OPTION_ARG_DOUBLE, &bench.max_latency_p99, "Fail above this p99 scroll to cover time", "MS" },
+                { NULL }
+        };
+        GOptionContext *context;
+        GError *error = NULL;
+        OSMesaContext osmesa;
+        void *framebuffer;
+        ArioCoverflow *coverflow;
+        ArioCoverflowPrivate *priv;
+        ArioCoverflowImage *image;
+        ArioCoverflowAlbum *album;
+        GdkEventScroll event;
+        GdkEventButton click;
+        GArray *frame_times, *present_times, *cover_times, *uploads, *decode_times, *append_times;
+        gint64 start, deadline, now;
+        guint64 bytes;
+        gdouble uploaded;
+        gchar *path, **setting;
+        gint i, j, target, direction = GDK_SCROLL_UP, timeouts = 0;
+        int status = 0;
+
+        context = g_option_context_new ("- coverflow benchmark");
+        g_option_context_add_main_entries (context, entries, NULL);
+        if (!g_option_context_parse (context, &argc, &argv, &error)) {
+                g_printerr ("%s\n", error->message);
+                return 1;
+        }
+        g_option_context_free (context);
+
+        if (!g_thread_supported ())
+                g_thread_init (NULL);
+        g_type_init ();
+
+        bench.conf = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+        for (setting = bench.settings; setting && *setting; setting++) {
+                gchar **pair = g_strsplit (*setting, "=", 2);
+
+                if (pair[0] && pair[1])
+                        g_hash_table_insert (bench.conf, g_strdup (pair[0]), g_strdup (pair[1]));
+                g_strfreev (pair);
+        }
+
+        bench.dir = g_dir_make_tmp ("ario-coverflow-bench-XXXXXX", &error);
+        if (bench.dir == NULL) {
+                g_printerr ("%s\n", error->message);
+                return 1;
+        }
+        start = g_get_monotonic_time ();
+        if (!ario_coverflow_fake_server_init (bench.dir, &bench.library, &error)) {
+                g_printerr ("Can't write the covers: %s\n", error->message);
+                remove_tree (bench.dir);
+                return 1;
+        }
+        g_print ("Generated %d albums and %d covers in %.0f ms\n", bench.library.n_albums,
+                 bench.library.n_covers, (g_get_monotonic_time () - start) / 1000.0);
+
+        osmesa = OSMesaCreateContextExt (OSMESA_RGBA, 24, 0, 0, NULL);
+        framebuffer = g_malloc (bench.width * bench.height * 4);
+        if (osmesa == NULL
+            || !OSMesaMakeCurrent (osmesa, framebuffer, GL_UNSIGNED_BYTE,
+                                   bench.width, bench.height)) {
+                g_printerr ("Can't create the OSMesa context\n");
+                return 1;
+        }
+
+        /* The object is never realized as a widget, only its model and
+         * its GL callbacks are used */
+        coverflow = g_new0 (ArioCoverflow, 1);
+        coverflow->priv = priv = g_new0 (ArioCoverflowPrivate, 1);
+        priv->connected = TRUE;
+        priv->visible = TRUE;
+        start = g_get_monotonic_time ();
+        init_model (coverflow);
+        g_print ("First page of %d albums in %.2f ms\n", ario_coverflow_albums_length (priv->albums),
+                 (g_get_monotonic_time () - start) / 1000.0);
+        while (priv->page_source)
+                g_main_context_iteration (NULL, TRUE);
+        g_print ("Album list loaded in %.2f ms\n", (g_get_monotonic_time () - start) / 1000.0);
+
+        /* Decode cost alone, out of the loader threads */
+        decode_times = g_array_new (FALSE, FALSE, sizeof (gdouble));
+        for (i = 0; i < MIN (ario_coverflow_albums_length (priv->albums), 100); i++) {
+                album = ario_coverflow_albums_index (priv->albums, i);
+                path = ario_cover_make_cover_path (album->artist, album->album, NORMAL_COVER);
+                start = g_get_monotonic_time ();
+                image = ario_coverflow_image_new_from_file (path, priv->cover_size,
+                                                            bench_conf_get_boolean (PREF_COVERFLOW_SMOOTH_COVERS,
+                                                                                    PREF_COVERFLOW_SMOOTH_COVERS_DEFAULT));
+                if (image) {
+                        add_sample (decode_times, start, g_get_monotonic_time ());
+                        ario_coverflow_image_unref (image);
+                }
+                g_free (path);
+        }
+
+        bench_realized = TRUE;
+        start = g_get_monotonic_time ();
+        realize (NULL, coverflow);
+        g_print ("GL initialized in %.2f ms\n", (g_get_monotonic_time () - start) / 1000.0);
+        configure_event (NULL, NULL, coverflow);
+        g_print ("Renderer: %s, %s, %s\n", (const gchar *) glGetString (GL_RENDERER),
+                 priv->instanced ? "instanced" : "fixed pipeline",
+                 priv->upload_map ? "PBO uploads" : "client memory uploads");
+        pump (coverflow, g_get_monotonic_time () + SETTLE_TIMEOUT, NULL);
+
+        frame_times = g_array_new (FALSE, FALSE, sizeof (gdouble));
+        present_times = g_array_new (FALSE, FALSE, sizeof (gdouble));
+        cover_times = g_array_new (FALSE, FALSE, sizeof (gdouble));
+        uploads = g_array_new (FALSE, FALSE, sizeof (gdouble));
+
+        memset (&event, 0, sizeof (event));
+        event.type = GDK_SCROLL;
+        for (i = 0; i < bench.n_scrolls; i++) {
+                /* Bounce at the ends of the list */
+                if (priv->position == ario_coverflow_albums_length (priv->albums) - 1)
+                        direction = GDK_SCROLL_DOWN;
+                else if (priv->position == 0)
+                        direction = GDK_SCROLL_UP;
+                event.direction = direction;
+                target = CLAMP (priv->position + (direction == GDK_SCROLL_UP ? bench.burst : -bench.burst),
+                                0, ario_coverflow_albums_length (priv->albums) - 1);
+
+                bytes = priv->bytes_uploaded;
+                start = g_get_monotonic_time ();
+                deadline = start + bench.interval * 1000;
+                for (j = 0; j < bench.burst; j++)
+                        scroll_event (NULL, &event, coverflow);
+
+                /* Time to the first frame at the new position, then to
+                 * the center cover */
+                while (priv->position != target && g_get_monotonic_time () < deadline)
+                        pump (coverflow, g_get_monotonic_time () + 1, frame_times);
+                pump (coverflow, g_get_monotonic_time () + 1, frame_times);
+                add_sample (present_times, start, g_get_monotonic_time ());
+
+                for (;;) {
+                        now = g_get_monotonic_time ();
+                        if (priv->slot_loaded[SLOT (target)]) {
+                                add_sample (cover_times, start, now);
+                                break;
+                        }
+                        if (now > start + SETTLE_TIMEOUT) {
+                                timeouts++;
+                                break;
+                        }
+                        pump (coverflow, now + 1000, frame_times);
+                }
+                pump (coverflow, deadline, frame_times);
+
+                uploaded = (priv->bytes_uploaded - bytes) / 1024.0;
+                g_array_append_val (uploads, uploaded);
+        }
+
+        /* Double clicks on the center cover */
+        append_times = g_array_new (FALSE, FALSE, sizeof (gdouble));
+        memset (&click, 0, sizeof (click));
+        click.type = GDK_2BUTTON_PRESS;
+        click.button = 1;
+        for (i = 0; i < bench.n_appends; i++) {
+                start = g_get_monotonic_time ();
+                button_press_event (NULL, &click, coverflow);
+                add_sample (append_times, start, g_get_monotonic_time ());
+        }
+
+        /* Database update, until the new list is in */
+        if (bench.n_rescanned > 0) {
+                start = g_get_monotonic_time ();
+                ario_coverflow_fake_server_rescan (bench.n_rescanned);
+                while (priv->page_source)
+                        g_main_context_iteration (NULL, TRUE);
+                g_print ("Database update of %d albums applied in %.2f ms\n", bench.n_rescanned,
+                         (g_get_monotonic_time () - start) / 1000.0);
+                pump (coverflow, g_get_monotonic_time () + SETTLE_TIMEOUT / 10, NULL);
+        }
+
+        g_print ("%d albums, %d scrolls of %d steps every %d ms, %dx%d, covers of %d\n",
+                 bench.library.n_albums, bench.n_scrolls, bench.burst, bench.interval,
+                 bench.width, bench.height, priv->cover_size);
+        report ("frame time", frame_times, "ms");
+        report ("scroll to present", present_times, "ms");
+        report ("scroll to cover", cover_times, "ms");
+        report ("uploaded per scroll", uploads, "KB");
+        report ("decode per cover", decode_times, "ms");
+        report ("playlist append", append_times, "ms");
+        g_print ("%-24s %" G_GUINT64_FORMAT " frames, %d covers late, %u albums appended\n", "total",
+                 bench.frames, timeouts, ario_coverflow_fake_server_appended ());
+
+        if (bench.max_frame_p99 > 0 && percentile (frame_times, 0.99) > bench.max_frame_p99) {
+                g_printerr ("p99 frame time over %.2f ms\n", bench.max_frame_p99);
+                status = 1;
+        }
+        if (bench.max_latency_p99 > 0 && percentile (cover_times, 0.99) > bench.max_latency_p99) {
+                g_printerr ("p99 scroll to cover time over %.2f ms\n", bench.max_latency_p99);
+                status = 1;
+        }
+
+        if (bench.stats && !ario_coverflow_stats_dump (bench.stats, &error)) {
+                g_printerr ("%s\n", error->message);
+                g_clear_error (&error);
+        }
+
+        /* As ario_coverflow_finalize: the loader threads are joined
+         * before the packs they write to are closed, and all of it
+         * before the tree goes */
+        ario_coverflow_paths_free (priv->paths);
+        ario_coverflow_loader_free (priv->loader);
+        if (priv->pack)
+                ario_coverflow_pack_close (priv->pack);
+        ario_coverflow_loader_free (priv->thumb_loader);
+        if (priv->thumbs)
+                ario_coverflow_pack_close (priv->thumbs);
+        ario_coverflow_fake_server_shutdown ();
+        unrealize (NULL, coverflow);
+        OSMesaDestroyContext (osmesa);
+        g_free (framebuffer);
+        remove_tree (bench.dir);
+
+        return status;
+}
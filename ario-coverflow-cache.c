@@ -0,0 +1,233 @@
+/*
+ *  Copyright (C) 2011 - Quentin Stievenart <quentin.stievenart@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "ario-coverflow-cache.h"
+#include "ario-coverflow-stats.h"
+#include <config.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#include "ario-debug.h"
+
+typedef struct
+{
+        const gchar *key;
+        gint64 mtime;
+        gint size;
+        gint n_levels;
+
+        /* The image itself, or its pixels compressed */
+        ArioCoverflowImage *image;
+        gchar *compressed;
+        gsize compressed_length;
+
+        GList link; /* in the LRU queue */
+} CacheEntry;
+
+struct ArioCoverflowCache
+{
+        gsize budget;
+        gsize bytes;
+        gboolean compress;
+
+        /* Key -> entry, and the entries, most recently used first */
+        GHashTable *entries;
+        GQueue lru;
+};
+
+static gsize
+entry_cost (CacheEntry *entry)
+{
+        return entry->image ? entry->image->length : entry->compressed_length;
+}
+
+static void
+entry_free (CacheEntry *entry)
+{
+        if (entry->image)
+                ario_coverflow_image_unref (entry->image);
+        g_free (entry->compressed);
+        g_slice_free (CacheEntry, entry);
+}
+
+static void
+ario_coverflow_cache_drop (ArioCoverflowCache *cache,
+                           CacheEntry *entry)
+{
+        g_queue_unlink (&cache->lru, &entry->link);
+        g_hash_table_remove (cache->entries, entry->key);
+        cache->bytes -= entry_cost (entry);
+        entry_free (entry);
+}
+
+ArioCoverflowCache *
+ario_coverflow_cache_new (gsize budget,
+                          gboolean compress)
+{
+        ArioCoverflowCache *cache;
+
+        cache = g_new0 (ArioCoverflowCache, 1);
+        cache->budget = budget;
+#ifdef HAVE_LZ4
+        cache->compress = compress;
+#else
+        if (compress)
+                ARIO_LOG_DBG ("Built without LZ4, covers are cached uncompressed");
+#endif
+        cache->entries = g_hash_table_new (g_direct_hash, g_direct_equal);
+        g_queue_init (&cache->lru);
+
+        return cache;
+}
+
+void
+ario_coverflow_cache_free (ArioCoverflowCache *cache)
+{
+        while (cache->lru.head)
+                ario_coverflow_cache_drop (cache, cache->lru.head->data);
+        g_hash_table_destroy (cache->entries);
+        g_free (cache);
+        ario_coverflow_stats_set (ARIO_COVERFLOW_STATS_CACHE_BYTES, 0);
+}
+
+#ifdef HAVE_LZ4
+/* Keeps the compressed pixels when they are worth it */
+static gboolean
+compress_entry (CacheEntry *entry,
+                ArioCoverflowImage *image)
+{
+        gint bound = LZ4_compressBound (image->length);
+        gint length;
+
+        entry->compressed = g_malloc (bound);
+        length = LZ4_compress_default ((const gchar *) image->pixels, entry->compressed,
+                                       image->length, bound);
+        if (length <= 0 || (gsize) length > image->length / 8 * 7) {
+                g_free (entry->compressed);
+                entry->compressed = NULL;
+                return FALSE;
+        }
+
+        entry->compressed = g_realloc (entry->compressed, length);
+        entry->compressed_length = length;
+        return TRUE;
+}
+#endif
+
+void
+ario_coverflow_cache_insert (ArioCoverflowCache *cache,
+                             const gchar *key,
+                             gint64 mtime,
+                             ArioCoverflowImage *image)
+{
+        CacheEntry *entry;
+
+        entry = g_hash_table_lookup (cache->entries, key);
+        if (entry)
+                ario_coverflow_cache_drop (cache, entry);
+        if (image->length > cache->budget)
+                return;
+
+        entry = g_slice_new0 (CacheEntry);
+        entry->key = key;
+        entry->mtime = mtime;
+        entry->size = image->size;
+        entry->n_levels = image->n_levels;
+        entry->link.data = entry;
+#ifdef HAVE_LZ4
+        if (!cache->compress || !compress_entry (entry, image))
+#endif
+                entry->image = ario_coverflow_image_ref (image);
+
+        g_hash_table_insert (cache->entries, (gpointer) key, entry);
+        g_queue_push_head_link (&cache->lru, &entry->link);
+        cache->bytes += entry_cost (entry);
+
+        while (cache->bytes > cache->budget) {
+                ario_coverflow_cache_drop (cache, cache->lru.tail->data);
+                ario_coverflow_stats_count (ARIO_COVERFLOW_STATS_CACHE_EVICTIONS, 1);
+        }
+        ario_coverflow_stats_set (ARIO_COVERFLOW_STATS_CACHE_BYTES, cache->bytes);
+}
+
+ArioCoverflowImage *
+ario_coverflow_cache_lookup (ArioCoverflowCache *cache,
+                             const gchar *key,
+                             gint64 mtime)
+{
+        CacheEntry *entry;
+        ArioCoverflowImage *image = NULL;
+
+        entry = g_hash_table_lookup (cache->entries, key);
+        if (entry && entry->mtime == mtime) {
+                if (entry->image) {
+                        image = ario_coverflow_image_ref (entry->image);
+#ifdef HAVE_LZ4
+                } else {
+                        image = ario_coverflow_image_new (entry->size, entry->n_levels);
+                        if (LZ4_decompress_safe (entry->compressed, (gchar *) image->data,
+                                                 entry->compressed_length,
+                                                 image->length) != (gint) image->length) {
+                                ario_coverflow_image_unref (image);
+                                image = NULL;
+                        }
+#endif
+                }
+        }
+
+        if (image == NULL) {
+                /* A stale entry is of no use any more */
+                if (entry)
+                        ario_coverflow_cache_drop (cache, entry);
+                ario_coverflow_stats_count (ARIO_COVERFLOW_STATS_CACHE_MISSES, 1);
+                ario_coverflow_stats_set (ARIO_COVERFLOW_STATS_CACHE_BYTES, cache->bytes);
+                return NULL;
+        }
+
+        g_queue_unlink (&cache->lru, &entry->link);
+        g_queue_push_head_link (&cache->lru, &entry->link);
+        ario_coverflow_stats_count (ARIO_COVERFLOW_STATS_CACHE_HITS, 1);
+
+        return image;
+}
+
+void
+ario_coverflow_cache_remove (ArioCoverflowCache *cache,
+                             const gchar *key)
+{
+        CacheEntry *entry;
+
+        entry = g_hash_table_lookup (cache->entries, key);
+        if (entry) {
+                ario_coverflow_cache_drop (cache, entry);
+                ario_coverflow_stats_set (ARIO_COVERFLOW_STATS_CACHE_BYTES, cache->bytes);
+        }
+}
+
+void
+ario_coverflow_cache_trim (ArioCoverflowCache *cache,
+                           gsize bytes)
+{
+        while (cache->bytes > bytes) {
+                ario_coverflow_cache_drop (cache, cache->lru.tail->data);
+                ario_coverflow_stats_count (ARIO_COVERFLOW_STATS_CACHE_EVICTIONS, 1);
+        }
+        ario_coverflow_stats_set (ARIO_COVERFLOW_STATS_CACHE_BYTES, cache->bytes);
+}
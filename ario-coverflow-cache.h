@@ -0,0 +1,59 @@
+/*
+ *  Copyright (C) 2011 - Quentin Stievenart <quentin.stievenart@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef __ARIO_COVERFLOW_CACHE_H
+#define __ARIO_COVERFLOW_CACHE_H
+
+#include <glib.h>
+#include "ario-coverflow-image.h"
+
+G_BEGIN_DECLS
+
+/* In-memory cache of decoded covers the view moved away from, within
+ * a byte budget, least recently used out first. Built with LZ4, the
+ * pixels can be kept compressed. Keys are interned strings, compared
+ * by address, and entries are checked against the mtime of the cover
+ * file like in the pack. Main thread only. */
+typedef struct ArioCoverflowCache ArioCoverflowCache;
+
+ArioCoverflowCache *    ario_coverflow_cache_new        (gsize budget,
+                                                         gboolean compress);
+
+void                    ario_coverflow_cache_free       (ArioCoverflowCache *cache);
+
+void                    ario_coverflow_cache_insert     (ArioCoverflowCache *cache,
+                                                         const gchar *key,
+                                                         gint64 mtime,
+                                                         ArioCoverflowImage *image);
+
+/* A new reference, or NULL */
+ArioCoverflowImage *    ario_coverflow_cache_lookup     (ArioCoverflowCache *cache,
+                                                         const gchar *key,
+                                                         gint64 mtime);
+
+void                    ario_coverflow_cache_remove     (ArioCoverflowCache *cache,
+                                                         const gchar *key);
+
+/* Evicts down to bytes, the budget itself stays */
+void                    ario_coverflow_cache_trim       (ArioCoverflowCache *cache,
+                                                         gsize bytes);
+
+G_END_DECLS
+
+#endif /* __ARIO_COVERFLOW_CACHE_H */
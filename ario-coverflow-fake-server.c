@@ -0,0 +1,480 @@
+/*
+ *  Copyright (C) 2011 - Quentin Stievenart <quentin.stievenart@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "ario-coverflow-fake-server.h"
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <string.h>
+#include <config.h>
+
+#include "ario-debug.h"
+
+/* Names are made of these, so that the letters and the typeahead
+ * see something like a real library */
+static const gchar *syllables[] = {
+        "an", "bel", "ca", "dor", "el", "fi", "go", "ha", "is", "jo", "ka",
+        "lu", "mar", "ne", "or", "pa", "qui", "ro", "sen", "ti", "um", "va",
+        "wen", "xa", "yo", "zu"
+};
+
+/* Scans come in all sizes */
+static const gint cover_sizes[] = { 150, 300, 500, 600, 700, 1000 };
+
+/* Only there to emit the server signals */
+typedef struct
+{
+        GObject parent;
+} FakeServer;
+
+typedef struct
+{
+        GObjectClass parent_class;
+} FakeServerClass;
+
+static struct
+{
+        gchar *dir;
+        ArioCoverflowFakeServerParams params;
+        FakeServer *object;
+
+        /* Sorted by artist then album, like the server does, and the
+         * set of their artist and album names */
+        GPtrArray *albums;
+        GHashTable *keys;
+        gint generation;
+
+        guint appended;
+} server;
+
+static guint dbtime_changed_signal;
+
+G_DEFINE_TYPE (FakeServer, fake_server, G_TYPE_OBJECT)
+
+static void
+fake_server_class_init (FakeServerClass *klass)
+{
+        dbtime_changed_signal = g_signal_new ("dbtime_changed",
+                                              G_OBJECT_CLASS_TYPE (klass),
+                                              G_SIGNAL_RUN_LAST,
+                                              0, NULL, NULL,
+                                              g_cclosure_marshal_VOID__VOID,
+                                              G_TYPE_NONE, 0);
+}
+
+static void
+fake_server_init (FakeServer *object)
+{
+}
+
+static gchar *
+make_name (GRand *rand,
+           gint words)
+{
+        GString *name = g_string_new (NULL);
+        gsize start;
+        gint i, n;
+
+        while (words--) {
+                if (name->len)
+                        g_string_append_c (name, ' ');
+                start = name->len;
+                n = g_rand_int_range (rand, 1, 4);
+                for (i = 0; i < n; i++)
+                        g_string_append (name, syllables[g_rand_int_range (rand, 0, G_N_ELEMENTS (syllables))]);
+                name->str[start] = g_ascii_toupper (name->str[start]);
+        }
+
+        return g_string_free (name, FALSE);
+}
+
+static gint
+compare_albums (gconstpointer a,
+                gconstpointer b)
+{
+        const ArioServerAlbum *album_a = *(ArioServerAlbum **) a;
+        const ArioServerAlbum *album_b = *(ArioServerAlbum **) b;
+        gint cmp;
+
+        cmp = g_ascii_strcasecmp (album_a->artist, album_b->artist);
+        if (cmp == 0)
+                cmp = g_ascii_strcasecmp (album_a->album, album_b->album);
+
+        return cmp;
+}
+
+static gchar *
+album_key (const ArioServerAlbum *album)
+{
+        return g_strconcat (album->artist, "\n", album->album, NULL);
+}
+
+/* Adds n albums to the library, in runs of albums of one artist */
+static void
+add_albums (GRand *rand,
+            gint n)
+{
+        ArioServerAlbum *album;
+        gchar *artist = NULL, *key;
+        gint left = 0;
+
+        while (n > 0) {
+                if (left == 0) {
+                        g_free (artist);
+                        artist = make_name (rand, g_rand_int_range (rand, 1, 3));
+                        left = g_rand_int_range (rand, 1, server.params.albums_per_artist + 1);
+                }
+
+                album = g_new0 (ArioServerAlbum, 1);
+                album->artist = g_strdup (artist);
+                album->album = make_name (rand, g_rand_int_range (rand, 1, 4));
+                album->date = g_strdup_printf ("%d", g_rand_int_range (rand, 1960, 2011));
+
+                /* Names collide now and then: draw again */
+                key = album_key (album);
+                if (g_hash_table_lookup (server.keys, key)) {
+                        g_free (key);
+                        ario_coverflow_fake_server_free_album (album);
+                        continue;
+                }
+                g_hash_table_insert (server.keys, key, key);
+                g_ptr_array_add (server.albums, album);
+                left--;
+                n--;
+        }
+        g_free (artist);
+
+        g_ptr_array_sort (server.albums, compare_albums);
+}
+
+static gchar *
+cover_filename (gint i,
+                gboolean png)
+{
+        gchar *filename, *path;
+
+        filename = g_strdup_printf ("cover-%04d.%s", i, png ? "png" : "jpg");
+        path = g_build_filename (server.dir, filename, NULL);
+        g_free (filename);
+
+        return path;
+}
+
+/* One cover in four is a PNG, half of those with some transparency */
+static gboolean
+make_covers (GError **error)
+{
+        GdkPixbuf *pixbuf;
+        GRand *rand;
+        guchar *pixels, *pixel;
+        gchar *path;
+        gint i, x, y, size, rowstride, r, g, b;
+        gboolean png, alpha, ret = TRUE;
+
+        for (i = 0; i < server.params.n_covers && ret; i++) {
+                rand = g_rand_new_with_seed (i);
+                size = cover_sizes[g_rand_int_range (rand, 0, G_N_ELEMENTS (cover_sizes))];
+                png = i % 4 == 3;
+                alpha = png && i % 8 == 7;
+                r = g_rand_int_range (rand, 0, 256);
+                g = g_rand_int_range (rand, 0, 256);
+                b = g_rand_int_range (rand, 0, 256);
+                g_rand_free (rand);
+
+                /* Gradients and a grid, so that the codecs have work to do */
+                pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, alpha, 8, size, size);
+                pixels = gdk_pixbuf_get_pixels (pixbuf);
+                rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+                for (y = 0; y < size; y++) {
+                        pixel = pixels + y * rowstride;
+                        for (x = 0; x < size; x++) {
+                                *pixel++ = r + x * 255 / size;
+                                *pixel++ = g + y * 255 / size;
+                                *pixel++ = ((x / 16) ^ (y / 16)) & 1 ? b : 255 - b;
+                                if (alpha)
+                                        *pixel++ = x < size / 8 || y < size / 8 ? 0x80 : 0xff;
+                        }
+                }
+
+                path = cover_filename (i, png);
+                if (png)
+                        ret = gdk_pixbuf_save (pixbuf, path, "png", error, NULL);
+                else
+                        ret = gdk_pixbuf_save (pixbuf, path, "jpeg", error, "quality", "90", NULL);
+                g_free (path);
+                g_object_unref (pixbuf);
+        }
+
+        return ret;
+}
+
+gboolean
+ario_coverflow_fake_server_init (const gchar *dir,
+                                 const ArioCoverflowFakeServerParams *params,
+                                 GError **error)
+{
+        GRand *rand;
+
+        ARIO_LOG_FUNCTION_START;
+
+        server.dir = g_strdup (dir);
+        server.params = *params;
+        server.params.n_covers = MAX (server.params.n_covers, 1);
+        server.params.albums_per_artist = MAX (server.params.albums_per_artist, 1);
+        server.object = g_object_new (fake_server_get_type (), NULL);
+        server.albums = g_ptr_array_sized_new (server.params.n_albums);
+        server.keys = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+        server.generation = 0;
+        server.appended = 0;
+
+        rand = g_rand_new_with_seed (server.params.n_albums);
+        add_albums (rand, server.params.n_albums);
+        g_rand_free (rand);
+
+        return make_covers (error);
+}
+
+void
+ario_coverflow_fake_server_shutdown (void)
+{
+        ARIO_LOG_FUNCTION_START;
+
+        if (server.albums) {
+                g_ptr_array_foreach (server.albums, (GFunc) ario_coverflow_fake_server_free_album, NULL);
+                g_ptr_array_free (server.albums, TRUE);
+                server.albums = NULL;
+        }
+        if (server.keys) {
+                g_hash_table_destroy (server.keys);
+                server.keys = NULL;
+        }
+        if (server.object) {
+                g_object_unref (server.object);
+                server.object = NULL;
+        }
+        g_free (server.dir);
+        server.dir = NULL;
+}
+
+void
+ario_coverflow_fake_server_rescan (gint n_changed)
+{
+        ArioServerAlbum *album;
+        GRand *rand;
+        gchar *key;
+        guint index;
+        gint i;
+
+        /* Each rescan changes the library the same way from one run
+         * to the next */
+        rand = g_rand_new_with_seed (server.params.n_albums + ++server.generation);
+        for (i = 0; i < n_changed && server.albums->len > 0; i++) {
+                index = g_rand_int_range (rand, 0, server.albums->len);
+                album = g_ptr_array_index (server.albums, index);
+                key = album_key (album);
+                g_hash_table_remove (server.keys, key);
+                g_free (key);
+                g_ptr_array_remove_index (server.albums, index);
+                ario_coverflow_fake_server_free_album (album);
+        }
+        add_albums (rand, n_changed);
+        g_rand_free (rand);
+
+        g_signal_emit (server.object, dbtime_changed_signal, 0);
+}
+
+ArioServer *
+ario_coverflow_fake_server_get_instance (void)
+{
+        return (ArioServer *) server.object;
+}
+
+guint
+ario_coverflow_fake_server_appended (void)
+{
+        return server.appended;
+}
+
+static void
+wait_latency (void)
+{
+        if (server.params.latency > 0)
+                g_usleep (server.params.latency * 1000);
+}
+
+static gboolean
+album_matches (const ArioServerAlbum *album,
+               const ArioServerCriteria *criteria)
+{
+        const ArioServerAtomicCriteria *atomic_criteria;
+        const GSList *tmp;
+
+        for (tmp = criteria; tmp; tmp = g_slist_next (tmp)) {
+                atomic_criteria = tmp->data;
+                if (atomic_criteria->tag == ARIO_TAG_ARTIST
+                    && strcmp (atomic_criteria->value, album->artist) != 0)
+                        return FALSE;
+                if (atomic_criteria->tag == ARIO_TAG_ALBUM
+                    && strcmp (atomic_criteria->value, album->album) != 0)
+                        return FALSE;
+        }
+
+        return TRUE;
+}
+
+/* Range of the albums the criteria can match: the albums of an
+ * artist are found by bisection, as they are sorted by artist */
+static void
+find_albums (const ArioServerCriteria *criteria,
+             guint *first,
+             guint *end)
+{
+        const ArioServerAtomicCriteria *atomic_criteria;
+        const ArioServerAlbum *album;
+        const GSList *tmp;
+        const gchar *artist = NULL;
+        guint low = 0, high = server.albums->len, middle;
+
+        for (tmp = criteria; tmp; tmp = g_slist_next (tmp)) {
+                atomic_criteria = tmp->data;
+                if (atomic_criteria->tag == ARIO_TAG_ARTIST)
+                        artist = atomic_criteria->value;
+        }
+
+        *first = 0;
+        *end = server.albums->len;
+        if (artist == NULL)
+                return;
+
+        while (low < high) {
+                middle = (low + high) / 2;
+                album = g_ptr_array_index (server.albums, middle);
+                if (g_ascii_strcasecmp (album->artist, artist) < 0)
+                        low = middle + 1;
+                else
+                        high = middle;
+        }
+        *first = low;
+        while (high < server.albums->len) {
+                album = g_ptr_array_index (server.albums, high);
+                if (g_ascii_strcasecmp (album->artist, artist) != 0)
+                        break;
+                high++;
+        }
+        *end = high;
+}
+
+/* Only the artists of the whole library, as the coverflow asks */
+GSList *
+ario_coverflow_fake_server_list_tags (ArioServerTag tag,
+                                      const ArioServerCriteria *criteria)
+{
+        ArioServerAlbum *album;
+        GSList *artists = NULL;
+        const gchar *last = NULL;
+        guint i;
+
+        g_return_val_if_fail (tag == ARIO_TAG_ARTIST && criteria == NULL, NULL);
+
+        wait_latency ();
+        for (i = 0; i < server.albums->len; i++) {
+                album = g_ptr_array_index (server.albums, i);
+                if (last && strcmp (last, album->artist) == 0)
+                        continue;
+                last = album->artist;
+                artists = g_slist_prepend (artists, g_strdup (album->artist));
+        }
+
+        return g_slist_reverse (artists);
+}
+
+GList *
+ario_coverflow_fake_server_get_albums (const ArioServerCriteria *criteria)
+{
+        ArioServerAlbum *album, *copy;
+        GList *albums = NULL;
+        guint i, first, end;
+
+        wait_latency ();
+        find_albums (criteria, &first, &end);
+        for (i = end; i-- > first;) {
+                album = g_ptr_array_index (server.albums, i);
+                if (!album_matches (album, criteria))
+                        continue;
+
+                copy = g_new0 (ArioServerAlbum, 1);
+                copy->artist = g_strdup (album->artist);
+                copy->album = g_strdup (album->album);
+                copy->date = g_strdup (album->date);
+                albums = g_list_prepend (albums, copy);
+        }
+
+        return albums;
+}
+
+void
+ario_coverflow_fake_server_free_album (ArioServerAlbum *album)
+{
+        if (album) {
+                g_free (album->artist);
+                g_free (album->album);
+                g_free (album->path);
+                g_free (album->date);
+                g_free (album);
+        }
+}
+
+gboolean
+ario_coverflow_fake_server_is_connected (void)
+{
+        return server.albums != NULL;
+}
+
+void
+ario_coverflow_fake_server_playlist_append_criterias (GSList *criterias,
+                                                      int action,
+                                                      int nb_entries)
+{
+        GSList *tmp;
+        guint i, first, end;
+
+        wait_latency ();
+        for (tmp = criterias; tmp; tmp = g_slist_next (tmp)) {
+                find_albums (tmp->data, &first, &end);
+                for (i = first; i < end; i++) {
+                        if (album_matches (g_ptr_array_index (server.albums, i), tmp->data))
+                                server.appended++;
+                }
+        }
+}
+
+/* The albums share the cover files, picked from a hash of their
+ * names. The path of a missing cover is one that doesn't exist */
+gchar *
+ario_coverflow_fake_server_make_cover_path (const gchar *artist,
+                                            const gchar *album,
+                                            ArioCoverHomeCoversSize size)
+{
+        guint hash = g_str_hash (artist) * 31 + g_str_hash (album);
+        gint i;
+
+        if (hash % 100 < (guint) server.params.missing)
+                return g_build_filename (server.dir, "missing.jpg", NULL);
+
+        i = (hash / 100) % server.params.n_covers;
+        return cover_filename (i, i % 4 == 3);
+}
@@ -0,0 +1,93 @@
+/*
+ *  Copyright (C) 2011 - Quentin Stievenart <quentin.stievenart@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef __ARIO_COVERFLOW_FAKE_SERVER_H
+#define __ARIO_COVERFLOW_FAKE_SERVER_H
+
+#include <glib.h>
+
+#include "covers/ario-cover.h"
+#include "servers/ario-server.h"
+
+G_BEGIN_DECLS
+
+/* A stand-in for the few server calls the coverflow makes, over a
+ * synthetic library that is the same from one run to the next: the
+ * artist and album names, which albums have a cover and what the
+ * cover files look like only depend on the parameters.
+ *
+ * Sources built with ARIO_COVERFLOW_FAKE_SERVER defined before this
+ * header is included talk to it instead of the real server */
+
+typedef struct
+{
+        gint n_albums;
+        gint albums_per_artist;         /* at most */
+        gint latency;                   /* ms added to each server request */
+        gint missing;                   /* % of the albums without a cover */
+        gint n_covers;                  /* distinct cover files, shared by the albums */
+} ArioCoverflowFakeServerParams;
+
+#define ARIO_COVERFLOW_FAKE_SERVER_PARAMS_DEFAULT { 1000, 6, 0, 10, 200 }
+
+/* The covers are written in dir, which must exist */
+gboolean                ario_coverflow_fake_server_init                 (const gchar *dir,
+                                                                         const ArioCoverflowFakeServerParams *params,
+                                                                         GError **error);
+
+void                    ario_coverflow_fake_server_shutdown             (void);
+
+/* Replaces n_changed albums by new ones and emits dbtime_changed */
+void                    ario_coverflow_fake_server_rescan               (gint n_changed);
+
+/* Number of albums appended to the playlist so far */
+guint                   ario_coverflow_fake_server_appended             (void);
+
+ArioServer *            ario_coverflow_fake_server_get_instance         (void);
+
+GSList *                ario_coverflow_fake_server_list_tags            (ArioServerTag tag,
+                                                                         const ArioServerCriteria *criteria);
+
+GList *                 ario_coverflow_fake_server_get_albums           (const ArioServerCriteria *criteria);
+
+void                    ario_coverflow_fake_server_free_album           (ArioServerAlbum *album);
+
+gboolean                ario_coverflow_fake_server_is_connected         (void);
+
+void                    ario_coverflow_fake_server_playlist_append_criterias (GSList *criterias,
+                                                                              int action,
+                                                                              int nb_entries);
+
+gchar *                 ario_coverflow_fake_server_make_cover_path      (const gchar *artist,
+                                                                         const gchar *album,
+                                                                         ArioCoverHomeCoversSize size);
+
+#ifdef ARIO_COVERFLOW_FAKE_SERVER
+#define ario_server_get_instance ario_coverflow_fake_server_get_instance
+#define ario_server_list_tags ario_coverflow_fake_server_list_tags
+#define ario_server_get_albums ario_coverflow_fake_server_get_albums
+#define ario_server_free_album ario_coverflow_fake_server_free_album
+#define ario_server_is_connected ario_coverflow_fake_server_is_connected
+#define ario_server_playlist_append_criterias ario_coverflow_fake_server_playlist_append_criterias
+#define ario_cover_make_cover_path ario_coverflow_fake_server_make_cover_path
+#endif
+
+G_END_DECLS
+
+#endif /* __ARIO_COVERFLOW_FAKE_SERVER_H */
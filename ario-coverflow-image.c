@@ -0,0 +1,350 @@
+/*
+ *  Copyright (C) 2011 Quentin Stievenart <quentin.stievenart@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "ario-coverflow-image.h"
+#include "ario-coverflow-pixels.h"
+#include "ario-coverflow-stats.h"
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <string.h>
+#include <config.h>
+#ifdef HAVE_LIBJPEG
+#include <setjmp.h>
+#include <jpeglib.h>
+#endif
+
+#include "ario-debug.h"
+
+/* Size of the reads fed to the pixbuf loader */
+#define READ_CHUNK 65536
+
+gint
+ario_coverflow_image_level_size (gint size,
+                                 gint level)
+{
+        return MAX (size >> level, 1);
+}
+
+gsize
+ario_coverflow_image_level_offset (gint size,
+                                   gint level)
+{
+        gsize offset = 0;
+        gint i, level_size;
+
+        for (i = 0; i < level; i++) {
+                level_size = ario_coverflow_image_level_size (size, i);
+                offset += (gsize) level_size * level_size * ARIO_COVERFLOW_IMAGE_CHANNELS;
+        }
+
+        return offset;
+}
+
+gint
+ario_coverflow_image_n_levels (gint size)
+{
+        gint n_levels = 1;
+
+        while (size > 1) {
+                size >>= 1;
+                n_levels++;
+        }
+
+        return n_levels;
+}
+
+gsize
+ario_coverflow_image_length (gint size,
+                             gint n_levels)
+{
+        return ario_coverflow_image_level_offset (size, n_levels);
+}
+
+static void
+ario_coverflow_image_downsample (const guchar *src,
+                                 gint src_size,
+                                 guchar *dst)
+{
+        gint x, y, c, dst_size = MAX (src_size / 2, 1);
+        gint src_stride = src_size * ARIO_COVERFLOW_IMAGE_CHANNELS;
+        const guchar *row0, *row1;
+
+        /* 2x2 box filter, the 1 pixel wide case only happens for 1x1 */
+        if (src_size == 1) {
+                memcpy (dst, src, ARIO_COVERFLOW_IMAGE_CHANNELS);
+                return;
+        }
+
+        for (y = 0; y < dst_size; y++) {
+                row0 = src + 2 * y * src_stride;
+                row1 = row0 + src_stride;
+                for (x = 0; x < dst_size; x++) {
+                        for (c = 0; c < ARIO_COVERFLOW_IMAGE_CHANNELS; c++) {
+                                *dst++ = (row0[c] + row0[c + ARIO_COVERFLOW_IMAGE_CHANNELS]
+                                          + row1[c] + row1[c + ARIO_COVERFLOW_IMAGE_CHANNELS] + 2) / 4;
+                        }
+                        row0 += 2 * ARIO_COVERFLOW_IMAGE_CHANNELS;
+                        row1 += 2 * ARIO_COVERFLOW_IMAGE_CHANNELS;
+                }
+        }
+}
+
+/* Pixels left to fill, through the data member */
+ArioCoverflowImage *
+ario_coverflow_image_new (gint size,
+                          gint n_levels)
+{
+        ArioCoverflowImage *image;
+
+        image = g_new0 (ArioCoverflowImage, 1);
+        image->refcount = 1;
+        image->size = size;
+        image->n_levels = n_levels;
+        image->length = ario_coverflow_image_length (size, n_levels);
+        image->data = g_malloc (image->length);
+        image->pixels = image->data;
+
+        return image;
+}
+
+#ifdef HAVE_LIBJPEG
+typedef struct
+{
+        struct jpeg_error_mgr pub;
+        jmp_buf jump;
+} JpegError;
+
+static void
+jpeg_error_exit (j_common_ptr cinfo)
+{
+        longjmp (((JpegError *) cinfo->err)->jump, 1);
+}
+
+static void
+jpeg_output_message (j_common_ptr cinfo)
+{
+        /* Warnings about slightly broken files are not worth a line
+         * per cover */
+}
+
+/* Decodes straight at the smallest scale of the IDCT (n/8) that is
+ * still at least size, without fancy chroma upsampling since the
+ * result is downscaled again. NULL when the pixbuf loader should
+ * have a go, e.g. for CMYK scans */
+static GdkPixbuf *
+decode_jpeg (FILE *file,
+             gint size)
+{
+        struct jpeg_decompress_struct cinfo;
+        JpegError error;
+        GdkPixbuf *volatile pixbuf = NULL;
+        JSAMPROW row;
+        gint shortest;
+
+        cinfo.err = jpeg_std_error (&error.pub);
+        error.pub.error_exit = jpeg_error_exit;
+        error.pub.output_message = jpeg_output_message;
+        if (setjmp (error.jump)) {
+                jpeg_destroy_decompress (&cinfo);
+                if (pixbuf)
+                        g_object_unref (pixbuf);
+                return NULL;
+        }
+
+        jpeg_create_decompress (&cinfo);
+        jpeg_stdio_src (&cinfo, file);
+        jpeg_read_header (&cinfo, TRUE);
+        if (cinfo.jpeg_color_space == JCS_CMYK
+            || cinfo.jpeg_color_space == JCS_YCCK) {
+                jpeg_destroy_decompress (&cinfo);
+                return NULL;
+        }
+
+        /* libjpeg 6b only has 1/2, 1/4 and 1/8, it takes the next
+         * bigger one */
+        shortest = MAX (MIN (cinfo.image_width, cinfo.image_height), 1);
+        cinfo.scale_num = CLAMP ((8 * size + shortest - 1) / shortest, 1, 8);
+        cinfo.scale_denom = 8;
+        cinfo.out_color_space = JCS_RGB;
+        cinfo.do_fancy_upsampling = FALSE;
+        jpeg_start_decompress (&cinfo);
+
+        pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8,
+                                 cinfo.output_width, cinfo.output_height);
+        while (cinfo.output_scanline < cinfo.output_height) {
+                row = gdk_pixbuf_get_pixels (pixbuf)
+                        + cinfo.output_scanline * gdk_pixbuf_get_rowstride (pixbuf);
+                jpeg_read_scanlines (&cinfo, &row, 1);
+        }
+        jpeg_finish_decompress (&cinfo);
+        jpeg_destroy_decompress (&cinfo);
+
+        return pixbuf;
+}
+#endif
+
+static void
+size_prepared_cb (GdkPixbufLoader *loader,
+                  gint width,
+                  gint height,
+                  gpointer data)
+{
+        gint size = GPOINTER_TO_INT (data);
+        gint shortest = MIN (width, height);
+
+        /* Big scans are decoded at a reduced size by the loaders that
+         * can (JPEG in the IDCT), and scaled once loaded by the others,
+         * keeping twice the final size for the filter to work with */
+        if (shortest > 2 * size)
+                gdk_pixbuf_loader_set_size (loader,
+                                            (gint64) width * 2 * size / shortest,
+                                            (gint64) height * 2 * size / shortest);
+}
+
+/* Any format gdk-pixbuf knows, fed in chunks as it is read */
+static GdkPixbuf *
+decode_with_loader (FILE *file,
+                    gint size)
+{
+        GdkPixbufLoader *loader;
+        GdkPixbuf *pixbuf = NULL;
+        guchar buffer[READ_CHUNK];
+        gsize length;
+        gboolean written = TRUE;
+
+        loader = gdk_pixbuf_loader_new ();
+        g_signal_connect (loader, "size-prepared",
+                          G_CALLBACK (size_prepared_cb), GINT_TO_POINTER (size));
+        while (written && (length = fread (buffer, 1, sizeof (buffer), file)) > 0)
+                written = gdk_pixbuf_loader_write (loader, buffer, length, NULL);
+        if (gdk_pixbuf_loader_close (loader, NULL) && written) {
+                pixbuf = gdk_pixbuf_loader_get_pixbuf (loader);
+                if (pixbuf)
+                        g_object_ref (pixbuf);
+        }
+        g_object_unref (loader);
+
+        return pixbuf;
+}
+
+/* Can be called from any thread. smooth selects the slower, better
+ * filter for the final downscale */
+ArioCoverflowImage *
+ario_coverflow_image_new_from_file (const gchar *path,
+                                    gint size,
+                                    gboolean smooth)
+{
+        ArioCoverflowImage *image;
+        GdkPixbuf *pixbuf = NULL, *scaled;
+        FILE *file;
+        gint level;
+        gint64 start = ario_coverflow_stats_now ();
+#ifdef HAVE_LIBJPEG
+        guchar magic[3];
+#endif
+
+        file = g_fopen (path, "rb");
+        if (file == NULL)
+                return NULL;
+#ifdef HAVE_LIBJPEG
+        if (fread (magic, 1, sizeof (magic), file) == sizeof (magic)
+            && memcmp (magic, "\xff\xd8\xff", sizeof (magic)) == 0) {
+                rewind (file);
+                pixbuf = decode_jpeg (file, size);
+        }
+        rewind (file);
+#endif
+        if (pixbuf == NULL)
+                pixbuf = decode_with_loader (file, size);
+        fclose (file);
+        if (pixbuf == NULL)
+                return NULL;
+
+        scaled = gdk_pixbuf_scale_simple (pixbuf, size, size,
+                                          smooth ? GDK_INTERP_HYPER : GDK_INTERP_BILINEAR);
+        g_object_unref (pixbuf);
+        if (scaled == NULL)
+                return NULL;
+        start = ario_coverflow_stats_time (ARIO_COVERFLOW_STATS_DECODE, start);
+
+        image = ario_coverflow_image_new (size, ario_coverflow_image_n_levels (size));
+
+        /* First level: drop the row padding and convert to the upload
+         * format */
+        ario_coverflow_pixels_to_bgra (gdk_pixbuf_get_pixels (scaled),
+                                       gdk_pixbuf_get_rowstride (scaled),
+                                       gdk_pixbuf_get_n_channels (scaled),
+                                       size, size, image->data,
+                                       ARIO_COVERFLOW_PIXELS_PREMULTIPLY);
+        g_object_unref (scaled);
+
+        for (level = 1; level < image->n_levels; level++) {
+                ario_coverflow_image_downsample (image->data + ario_coverflow_image_level_offset (size, level - 1),
+                                                 ario_coverflow_image_level_size (size, level - 1),
+                                                 image->data + ario_coverflow_image_level_offset (size, level));
+        }
+        ario_coverflow_stats_time (ARIO_COVERFLOW_STATS_CONVERT, start);
+
+        return image;
+}
+
+ArioCoverflowImage *
+ario_coverflow_image_new_mapped (GMappedFile *mapping,
+                                 gsize offset,
+                                 gint size,
+                                 gint n_levels)
+{
+        ArioCoverflowImage *image;
+
+        image = g_new0 (ArioCoverflowImage, 1);
+        image->refcount = 1;
+        image->size = size;
+        image->n_levels = n_levels;
+        image->length = ario_coverflow_image_length (size, n_levels);
+        image->mapping = g_mapped_file_ref (mapping);
+        image->pixels = (const guchar *) g_mapped_file_get_contents (mapping) + offset;
+
+        return image;
+}
+
+gboolean
+ario_coverflow_image_is_mapped (ArioCoverflowImage *image)
+{
+        return image->mapping != NULL;
+}
+
+ArioCoverflowImage *
+ario_coverflow_image_ref (ArioCoverflowImage *image)
+{
+        g_atomic_int_inc (&image->refcount);
+        return image;
+}
+
+void
+ario_coverflow_image_unref (ArioCoverflowImage *image)
+{
+        if (!g_atomic_int_dec_and_test (&image->refcount))
+                return;
+
+        if (image->mapping)
+                g_mapped_file_unref (image->mapping);
+        g_free (image->data);
+        g_free (image);
+}
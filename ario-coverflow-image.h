@@ -0,0 +1,77 @@
+/*
+ *  Copyright (C) 2011 - Quentin Stievenart <quentin.stievenart@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef __ARIO_COVERFLOW_IMAGE_H
+#define __ARIO_COVERFLOW_IMAGE_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define ARIO_COVERFLOW_IMAGE_CHANNELS 4
+
+/* A cover ready to be uploaded: a square, power-of-two BGRA image, with
+ * premultiplied alpha, and its
+ * full mip chain, tightly packed one level after the other */
+typedef struct
+{
+        gint size;
+        gint n_levels;
+        const guchar *pixels;
+        gsize length;
+
+        /*< private >*/
+        gint refcount;
+        guchar *data;
+        GMappedFile *mapping;
+} ArioCoverflowImage;
+
+ArioCoverflowImage *    ario_coverflow_image_new                (gint size,
+                                                                 gint n_levels);
+
+ArioCoverflowImage *    ario_coverflow_image_new_from_file      (const gchar *path,
+                                                                 gint size,
+                                                                 gboolean smooth);
+
+ArioCoverflowImage *    ario_coverflow_image_new_mapped         (GMappedFile *mapping,
+                                                                 gsize offset,
+                                                                 gint size,
+                                                                 gint n_levels);
+
+/* Whether the pixels are in the pack rather than on the heap */
+gboolean                ario_coverflow_image_is_mapped          (ArioCoverflowImage *image);
+
+ArioCoverflowImage *    ario_coverflow_image_ref                (ArioCoverflowImage *image);
+
+void                    ario_coverflow_image_unref              (ArioCoverflowImage *image);
+
+gint                    ario_coverflow_image_level_size         (gint size,
+                                                                 gint level);
+
+gsize                   ario_coverflow_image_level_offset       (gint size,
+                                                                 gint level);
+
+gint                    ario_coverflow_image_n_levels           (gint size);
+
+gsize                   ario_coverflow_image_length             (gint size,
+                                                                 gint n_levels);
+
+G_END_DECLS
+
+#endif /* __ARIO_COVERFLOW_IMAGE_H */
@@ -0,0 +1,283 @@
+/*
+ *  Copyright (C) 2011 Quentin Stievenart <quentin.stievenart@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "ario-coverflow-loader.h"
+#include <string.h>
+#include <config.h>
+
+#include "ario-debug.h"
+
+#define LOADER_THREADS 2
+
+typedef struct
+{
+        const gchar *key;
+        gchar *path;
+        gint64 mtime;
+        ArioCoverflowImage *image;
+
+        gint priority;
+        guint serial;
+        gint cancelled;
+        gint started;
+        gboolean skipped;
+} ArioCoverflowJob;
+
+struct ArioCoverflowLoader
+{
+        ArioCoverflowLoaderFunc func;
+        gpointer data;
+
+        ArioCoverflowPack *pack;
+        gint size;
+        gboolean smooth;
+
+        /* Thumbnails are cut from the decoded covers */
+        ArioCoverflowPack *thumbs;
+        gint thumb_size;
+
+        GThreadPool *pool;
+        GAsyncQueue *done;
+
+        /* Keys (interned strings) of the jobs not dispatched yet,
+         * only touched from the main loop */
+        GHashTable *pending;
+
+        guint serial;
+        gint dispatch_scheduled; /* its id is not kept, workers add it */
+        gint shutting_down;
+};
+
+static void ario_coverflow_loader_decode (gpointer job_data, gpointer loader_data);
+static gboolean ario_coverflow_loader_dispatch (gpointer data);
+
+static gint
+ario_coverflow_job_compare (gconstpointer a,
+                            gconstpointer b,
+                            gpointer data)
+{
+        const ArioCoverflowJob *job_a = a;
+        const ArioCoverflowJob *job_b = b;
+
+        if (job_a->priority != job_b->priority)
+                return job_a->priority < job_b->priority ? -1 : 1;
+
+        /* First requested, first decoded */
+        return job_a->serial < job_b->serial ? -1 : job_a->serial > job_b->serial;
+}
+
+static void
+ario_coverflow_job_free (ArioCoverflowJob *job)
+{
+        if (job->image)
+                ario_coverflow_image_unref (job->image);
+        g_free (job->path);
+        g_free (job);
+}
+
+ArioCoverflowLoader *
+ario_coverflow_loader_new (ArioCoverflowPack *pack,
+                           gint size,
+                           gboolean smooth,
+                           ArioCoverflowPack *thumbs,
+                           gint thumb_size,
+                           ArioCoverflowLoaderFunc func,
+                           gpointer data)
+{
+        ARIO_LOG_FUNCTION_START;
+        ArioCoverflowLoader *loader;
+
+        if (!g_thread_supported ())
+                g_thread_init (NULL);
+
+        loader = g_new0 (ArioCoverflowLoader, 1);
+        loader->func = func;
+        loader->data = data;
+        loader->pack = pack;
+        loader->size = size;
+        loader->smooth = smooth;
+        loader->thumbs = thumbs;
+        loader->thumb_size = thumb_size;
+        loader->done = g_async_queue_new ();
+        loader->pending = g_hash_table_new (g_direct_hash, g_direct_equal);
+        loader->pool = g_thread_pool_new (ario_coverflow_loader_decode, loader,
+                                          LOADER_THREADS, FALSE, NULL);
+        g_thread_pool_set_sort_function (loader->pool, ario_coverflow_job_compare, NULL);
+
+        return loader;
+}
+
+void
+ario_coverflow_loader_free (ArioCoverflowLoader *loader)
+{
+        ARIO_LOG_FUNCTION_START;
+        ArioCoverflowJob *job;
+
+        /* Queued jobs are skipped by the workers once this is set */
+        g_atomic_int_set (&loader->shutting_down, TRUE);
+        g_thread_pool_free (loader->pool, FALSE, TRUE);
+
+        /* The workers are gone, so no dispatch can be added anymore */
+        if (g_atomic_int_get (&loader->dispatch_scheduled))
+                g_idle_remove_by_data (loader);
+
+        while ((job = g_async_queue_try_pop (loader->done)))
+                ario_coverflow_job_free (job);
+        g_async_queue_unref (loader->done);
+        g_hash_table_destroy (loader->pending);
+
+        g_free (loader);
+}
+
+void
+ario_coverflow_loader_request (ArioCoverflowLoader *loader,
+                               const gchar *key,
+                               const gchar *path,
+                               gint64 mtime,
+                               gint priority)
+{
+        ArioCoverflowJob *job;
+
+        job = g_hash_table_lookup (loader->pending, key);
+        if (job && job->mtime == mtime
+            && (priority >= job->priority || g_atomic_int_get (&job->started))) {
+                /* Wanted again: if a worker skipped it meanwhile, it is
+                 * pushed back when dispatched */
+                g_atomic_int_set (&job->cancelled, FALSE);
+                return;
+        }
+
+        /* Wanted sooner, or the file changed: the pool sorts on the
+         * priority, so it can't change in place. The queued job is
+         * cancelled and dropped when dispatched, a new one takes its
+         * place */
+        if (job)
+                g_atomic_int_set (&job->cancelled, TRUE);
+
+        job = g_new0 (ArioCoverflowJob, 1);
+        job->key = key;
+        job->path = g_strdup (path);
+        job->mtime = mtime;
+        job->priority = priority;
+        job->serial = loader->serial++;
+
+        g_hash_table_insert (loader->pending, (gpointer) key, job);
+        g_thread_pool_push (loader->pool, job, NULL);
+}
+
+void
+ario_coverflow_loader_cancel (ArioCoverflowLoader *loader,
+                              const gchar *key)
+{
+        ArioCoverflowJob *job;
+
+        job = g_hash_table_lookup (loader->pending, key);
+        if (job)
+                g_atomic_int_set (&job->cancelled, TRUE);
+}
+
+gboolean
+ario_coverflow_loader_is_pending (ArioCoverflowLoader *loader,
+                                  const gchar *key)
+{
+        return g_hash_table_lookup (loader->pending, key) != NULL;
+}
+
+/* The last levels of a decoded cover make its thumbnail. Runs in a
+ * worker thread */
+static void
+ario_coverflow_loader_add_thumb (ArioCoverflowLoader *loader,
+                                 ArioCoverflowJob *job)
+{
+        ArioCoverflowImage *thumb;
+        gint n_levels = ario_coverflow_image_n_levels (loader->thumb_size);
+        gint level = job->image->n_levels - n_levels;
+
+        if (level < 0
+            || ario_coverflow_image_level_size (job->image->size, level) != loader->thumb_size)
+                return;
+
+        thumb = ario_coverflow_image_new (loader->thumb_size, n_levels);
+        memcpy (thumb->data,
+                job->image->pixels + ario_coverflow_image_level_offset (job->image->size, level),
+                thumb->length);
+        ario_coverflow_pack_add (loader->thumbs, job->key, job->mtime, thumb);
+        ario_coverflow_image_unref (thumb);
+}
+
+/* Runs in a worker thread */
+static void
+ario_coverflow_loader_decode (gpointer job_data,
+                              gpointer loader_data)
+{
+        ArioCoverflowJob *job = (ArioCoverflowJob *) job_data;
+        ArioCoverflowLoader *loader = (ArioCoverflowLoader *) loader_data;
+
+        if (g_atomic_int_get (&loader->shutting_down)
+            || g_atomic_int_get (&job->cancelled)) {
+                job->skipped = TRUE;
+        } else if (job->path) {
+                /* Too late to be replaced by a more urgent request */
+                g_atomic_int_set (&job->started, TRUE);
+                job->image = ario_coverflow_image_new_from_file (job->path, loader->size,
+                                                                 loader->smooth);
+        }
+
+        if (job->image && loader->pack)
+                ario_coverflow_pack_add (loader->pack, job->key, job->mtime, job->image);
+        if (job->image && loader->thumbs)
+                ario_coverflow_loader_add_thumb (loader, job);
+
+        g_async_queue_push (loader->done, job);
+
+        /* Only one dispatch source at a time, it drains the whole queue */
+        if (g_atomic_int_compare_and_exchange (&loader->dispatch_scheduled, FALSE, TRUE))
+                g_idle_add (ario_coverflow_loader_dispatch, loader);
+}
+
+static gboolean
+ario_coverflow_loader_dispatch (gpointer data)
+{
+        ArioCoverflowLoader *loader = (ArioCoverflowLoader *) data;
+        ArioCoverflowJob *job;
+
+        g_atomic_int_set (&loader->dispatch_scheduled, FALSE);
+
+        while ((job = g_async_queue_try_pop (loader->done))) {
+                /* Replaced by a more urgent request for the same key,
+                 * which calls back instead */
+                if (g_hash_table_lookup (loader->pending, job->key) != job) {
+                        ario_coverflow_job_free (job);
+                        continue;
+                }
+
+                if (job->skipped && !g_atomic_int_get (&job->cancelled)) {
+                        job->skipped = FALSE;
+                        g_thread_pool_push (loader->pool, job, NULL);
+                        continue;
+                }
+
+                g_hash_table_remove (loader->pending, job->key);
+                if (!job->skipped)
+                        loader->func (job->key, job->mtime, job->image, loader->data);
+                ario_coverflow_job_free (job);
+        }
+
+        return FALSE;
+}
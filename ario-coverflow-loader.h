@@ -0,0 +1,71 @@
+/*
+ *  Copyright (C) 2011 - Quentin Stievenart <quentin.stievenart@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef __ARIO_COVERFLOW_LOADER_H
+#define __ARIO_COVERFLOW_LOADER_H
+
+#include <glib.h>
+#include "ario-coverflow-image.h"
+#include "ario-coverflow-pack.h"
+
+G_BEGIN_DECLS
+
+typedef struct ArioCoverflowLoader ArioCoverflowLoader;
+
+/* Called in the main loop once a cover is decoded, with the mtime it was
+ * requested with. image is NULL if the cover could not be loaded, and
+ * is owned by the loader. Decoded
+ * covers are also stored in the pack, if any, and their last levels in
+ * the thumbs pack, if any, by the worker threads. Keys are
+ * interned strings and compared by address.
+ * Requests with a lower priority are decoded first, and a key requested
+ * again with a lower one than it is queued with is moved forward, or
+ * decoded again if its mtime changed. A
+ * cancelled request that was not started yet is dropped without calling
+ * back. */
+typedef void (*ArioCoverflowLoaderFunc) (const gchar *key,
+                                         gint64 mtime,
+                                         ArioCoverflowImage *image,
+                                         gpointer data);
+
+ArioCoverflowLoader *   ario_coverflow_loader_new        (ArioCoverflowPack *pack,
+                                                          gint size,
+                                                          gboolean smooth,
+                                                          ArioCoverflowPack *thumbs,
+                                                          gint thumb_size,
+                                                          ArioCoverflowLoaderFunc func,
+                                                          gpointer data);
+
+void                    ario_coverflow_loader_free       (ArioCoverflowLoader *loader);
+
+void                    ario_coverflow_loader_request    (ArioCoverflowLoader *loader,
+                                                          const gchar *key,
+                                                          const gchar *path,
+                                                          gint64 mtime,
+                                                          gint priority);
+
+void                    ario_coverflow_loader_cancel     (ArioCoverflowLoader *loader,
+                                                          const gchar *key);
+
+gboolean                ario_coverflow_loader_is_pending (ArioCoverflowLoader *loader,
+                                                          const gchar *key);
+
+G_END_DECLS
+
+#endif /* __ARIO_COVERFLOW_LOADER_H */
@@ -0,0 +1,549 @@
+/*
+ *  Copyright (C) 2011 Quentin Stievenart <quentin.stievenart@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "ario-coverflow-pack.h"
+#include <glib/gstdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <config.h>
+
+#include "ario-debug.h"
+
+/*
+ * The pack starts with a header, followed by records appended one after
+ * the other:
+ *   RecordHeader | key | padding | pixels (all mip levels) | padding
+ * A record replaces any previous one with the same key, the space of the
+ * older ones is reclaimed when the pack is opened. The file is kept
+ * within a byte budget: once a record would not fit, the least recently
+ * used ones are evicted and the others copied to a new file. The time
+ * of the last use is kept in the record header, rewritten once per
+ * USED_RESOLUTION at most.
+ * Lookups come from the main loop, so they never write: the use times
+ * and a compaction found due at open are left to the next add, made by
+ * a loader thread.
+ */
+#define PACK_MAGIC "ARIOCFPK"
+#define PACK_VERSION 3
+#define RECORD_MAGIC 0x43524643
+#define PACK_ALIGN 16
+#define PACK_MAX_KEY 4096
+#define COMPACT_THRESHOLD (8 << 20) /* dead bytes before compacting */
+#define COMPACT_TARGET(budget) ((budget) / 4 * 3) /* live bytes left by an eviction */
+#define USED_RESOLUTION 3600 /* s */
+
+#define ALIGN(x) (((x) + PACK_ALIGN - 1) & ~((gsize) PACK_ALIGN - 1))
+
+typedef struct
+{
+        gchar magic[8];
+        guint32 version;
+        guint32 channels;
+} PackHeader;
+
+typedef struct
+{
+        guint32 magic;
+        guint32 key_length;
+        gint64 mtime;
+        guint32 size;
+        guint32 n_levels;
+        guint64 data_length;
+        gint64 used; /* s since the epoch */
+} RecordHeader;
+
+typedef struct
+{
+        const gchar *key;
+        gsize offset;
+        gsize length;
+        gsize data_offset;
+        gint64 mtime;
+        gint size;
+        gint n_levels;
+        gint64 used, stored_used;
+        gboolean touched; /* used is to be written */
+        gsize new_offset; /* while compacting */
+} PackEntry;
+
+struct ArioCoverflowPack
+{
+        gchar *filename;
+        int fd;
+        gsize end;
+
+        GMappedFile *mapping;
+        gsize mapped_length;
+
+        /* Interned key -> PackEntry */
+        GHashTable *entries;
+        gsize dead;
+
+        /* Records are not added while compacting, nor once a
+         * compaction failed to make room or, without evict, once the
+         * budget is reached */
+        gsize budget;
+        gboolean evict;
+        gboolean compacting;
+        gboolean full;
+
+        /* Left to the next add: the compaction found due at open, to
+         * compact_live bytes, and the keys of the entries touched */
+        gboolean compact_pending;
+        gsize compact_live;
+        GPtrArray *touched;
+
+        GMutex *lock;
+};
+
+static gboolean
+ario_coverflow_pack_remap (ArioCoverflowPack *pack)
+{
+        GError *error = NULL;
+
+        if (pack->mapping)
+                g_mapped_file_unref (pack->mapping);
+        pack->mapping = NULL;
+        pack->mapped_length = 0;
+
+        pack->mapping = g_mapped_file_new (pack->filename, FALSE, &error);
+        if (pack->mapping == NULL) {
+                ARIO_LOG_DBG ("Can't map %s: %s", pack->filename, error->message);
+                g_error_free (error);
+                return FALSE;
+        }
+        pack->mapped_length = g_mapped_file_get_length (pack->mapping);
+
+        return TRUE;
+}
+
+static gboolean
+ario_coverflow_pack_reset (ArioCoverflowPack *pack)
+{
+        PackHeader header;
+
+        memset (&header, 0, sizeof (header));
+        memcpy (header.magic, PACK_MAGIC, sizeof (header.magic));
+        header.version = PACK_VERSION;
+        header.channels = ARIO_COVERFLOW_IMAGE_CHANNELS;
+
+        g_hash_table_remove_all (pack->entries);
+        pack->dead = 0;
+        pack->end = sizeof (header);
+
+        return ftruncate (pack->fd, 0) == 0
+                && pwrite (pack->fd, &header, sizeof (header), 0) == sizeof (header);
+}
+
+static void
+ario_coverflow_pack_scan (ArioCoverflowPack *pack)
+{
+        const gchar *contents = g_mapped_file_get_contents (pack->mapping);
+        const gchar *key;
+        gchar *tmp;
+        RecordHeader record;
+        PackEntry *entry, *old;
+        gsize offset = sizeof (PackHeader);
+        gsize length;
+
+        while (offset + sizeof (record) <= pack->mapped_length) {
+                memcpy (&record, contents + offset, sizeof (record));
+                if (record.magic != RECORD_MAGIC
+                    || record.key_length == 0
+                    || record.key_length > PACK_MAX_KEY
+                    || record.data_length != ario_coverflow_image_length (record.size, record.n_levels))
+                        break;
+
+                length = ALIGN (sizeof (record) + record.key_length) + ALIGN (record.data_length);
+                if (offset + length > pack->mapped_length)
+                        break;
+
+                tmp = g_strndup (contents + offset + sizeof (record), record.key_length);
+                key = g_intern_string (tmp);
+                g_free (tmp);
+
+                entry = g_new0 (PackEntry, 1);
+                entry->key = key;
+                entry->offset = offset;
+                entry->length = length;
+                entry->data_offset = offset + ALIGN (sizeof (record) + record.key_length);
+                entry->mtime = record.mtime;
+                entry->size = record.size;
+                entry->n_levels = record.n_levels;
+                entry->used = entry->stored_used = record.used;
+
+                old = g_hash_table_lookup (pack->entries, key);
+                if (old)
+                        pack->dead += old->length;
+                g_hash_table_insert (pack->entries, (gpointer) key, entry);
+
+                offset += length;
+        }
+
+        /* Drop a record left half written by a crash */
+        if (offset < pack->mapped_length) {
+                ARIO_LOG_DBG ("Truncating %s at %" G_GSIZE_FORMAT, pack->filename, offset);
+                if (ftruncate (pack->fd, offset) != 0)
+                        ARIO_LOG_DBG ("Can't truncate %s", pack->filename);
+        }
+        pack->end = offset;
+}
+
+static gint
+compare_used (gconstpointer a,
+              gconstpointer b)
+{
+        const PackEntry *entry_a = *(PackEntry * const *) a;
+        const PackEntry *entry_b = *(PackEntry * const *) b;
+
+        if (entry_a->used != entry_b->used)
+                return entry_a->used < entry_b->used ? -1 : 1;
+        return entry_a->offset < entry_b->offset ? -1 : entry_a->offset > entry_b->offset;
+}
+
+/* Writes the use times of the entries looked up, called with the lock
+ * held */
+static void
+ario_coverflow_pack_flush (ArioCoverflowPack *pack)
+{
+        PackEntry *entry;
+        guint i;
+
+        for (i = 0; i < pack->touched->len; i++) {
+                /* Evicted meanwhile, or replaced */
+                entry = g_hash_table_lookup (pack->entries, g_ptr_array_index (pack->touched, i));
+                if (entry == NULL || !entry->touched)
+                        continue;
+                entry->touched = FALSE;
+                if (pwrite (pack->fd, &entry->used, sizeof (entry->used),
+                            entry->offset + G_STRUCT_OFFSET (RecordHeader, used)) == sizeof (entry->used))
+                        entry->stored_used = entry->used;
+        }
+        g_ptr_array_set_size (pack->touched, 0);
+}
+
+/* Evicts the least recently used records down to live bytes, then
+ * copies the others to a new file. Called and returns with the lock
+ * held, but copies without it: lookups keep reading the old file,
+ * which stays mapped, and adds are skipped meanwhile */
+static void
+ario_coverflow_pack_compact (ArioCoverflowPack *pack,
+                             gsize live)
+{
+        GMappedFile *mapping;
+        const gchar *contents;
+        GPtrArray *kept;
+        GHashTableIter iter;
+        PackEntry *entry;
+        gchar *tmp_filename;
+        gsize offset = sizeof (PackHeader), total = 0;
+        gboolean success;
+        guint i;
+        int fd;
+
+        if (pack->mapped_length < pack->end && !ario_coverflow_pack_remap (pack))
+                return;
+
+        kept = g_ptr_array_new ();
+        g_hash_table_iter_init (&iter, pack->entries);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &entry)) {
+                g_ptr_array_add (kept, entry);
+                total += entry->length;
+        }
+
+        /* Oldest first, those go */
+        g_ptr_array_sort (kept, compare_used);
+        for (i = 0; i < kept->len && total > live; i++) {
+                entry = g_ptr_array_index (kept, i);
+                total -= entry->length;
+                pack->dead += entry->length;
+                g_hash_table_remove (pack->entries, entry->key);
+        }
+        g_ptr_array_remove_range (kept, 0, i);
+        ARIO_LOG_DBG ("Compacting %s: %u records evicted, %" G_GSIZE_FORMAT " dead bytes",
+                      pack->filename, i, pack->dead);
+
+        for (i = 0; i < kept->len; i++) {
+                entry = g_ptr_array_index (kept, i);
+                entry->new_offset = offset;
+                offset += entry->length;
+        }
+
+        pack->compacting = TRUE;
+        mapping = g_mapped_file_ref (pack->mapping);
+        g_mutex_unlock (pack->lock);
+
+        contents = g_mapped_file_get_contents (mapping);
+        tmp_filename = g_strconcat (pack->filename, ".tmp", NULL);
+        fd = g_open (tmp_filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        success = fd >= 0
+                && pwrite (fd, contents, sizeof (PackHeader), 0) == sizeof (PackHeader);
+        for (i = 0; i < kept->len && success; i++) {
+                entry = g_ptr_array_index (kept, i);
+                success = pwrite (fd, contents + entry->offset, entry->length,
+                                  entry->new_offset) == (ssize_t) entry->length;
+        }
+        g_mapped_file_unref (mapping);
+
+        g_mutex_lock (pack->lock);
+        pack->compacting = FALSE;
+        if (success && g_rename (tmp_filename, pack->filename) == 0) {
+                for (i = 0; i < kept->len; i++) {
+                        entry = g_ptr_array_index (kept, i);
+                        entry->data_offset = entry->data_offset - entry->offset + entry->new_offset;
+                        entry->offset = entry->new_offset;
+                }
+                close (pack->fd);
+                pack->fd = fd;
+                pack->end = offset;
+                pack->dead = 0;
+                ario_coverflow_pack_remap (pack);
+        } else {
+                /* The old file is still whole, it just stops
+                 * growing */
+                ARIO_LOG_DBG ("Can't compact %s", pack->filename);
+                if (fd >= 0)
+                        close (fd);
+                g_unlink (tmp_filename);
+                pack->full = TRUE;
+        }
+        g_free (tmp_filename);
+        g_ptr_array_free (kept, TRUE);
+}
+
+ArioCoverflowPack *
+ario_coverflow_pack_open (const gchar *filename,
+                          gsize budget,
+                          gboolean evict)
+{
+        ARIO_LOG_FUNCTION_START;
+        ArioCoverflowPack *pack;
+        PackHeader header;
+
+        pack = g_new0 (ArioCoverflowPack, 1);
+        pack->filename = g_strdup (filename);
+        pack->budget = budget;
+        pack->evict = evict;
+        pack->entries = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                               NULL, g_free);
+        pack->touched = g_ptr_array_new ();
+        pack->lock = g_mutex_new ();
+
+        pack->fd = g_open (filename, O_RDWR | O_CREAT, 0644);
+        if (pack->fd < 0) {
+                ARIO_LOG_DBG ("Can't open %s", filename);
+                ario_coverflow_pack_close (pack);
+                return NULL;
+        }
+
+        if (pread (pack->fd, &header, sizeof (header), 0) != sizeof (header)
+            || memcmp (header.magic, PACK_MAGIC, sizeof (header.magic)) != 0
+            || header.version != PACK_VERSION
+            || header.channels != ARIO_COVERFLOW_IMAGE_CHANNELS) {
+                if (!ario_coverflow_pack_reset (pack)) {
+                        ARIO_LOG_DBG ("Can't initialize %s", filename);
+                        ario_coverflow_pack_close (pack);
+                        return NULL;
+                }
+        }
+
+        if (!ario_coverflow_pack_remap (pack)) {
+                ario_coverflow_pack_close (pack);
+                return NULL;
+        }
+
+        /* Also when the budget was lowered since the last time. Until
+         * then, the records past it are read but nothing is added */
+        ario_coverflow_pack_scan (pack);
+        if (pack->end > budget) {
+                pack->compact_pending = TRUE;
+                pack->compact_live = evict ? COMPACT_TARGET (budget) : G_MAXSIZE;
+        } else if (pack->dead > COMPACT_THRESHOLD && pack->dead > pack->end / 2) {
+                pack->compact_pending = TRUE;
+                pack->compact_live = G_MAXSIZE;
+        }
+
+        ARIO_LOG_DBG ("%d covers in %s", g_hash_table_size (pack->entries), filename);
+        return pack;
+}
+
+void
+ario_coverflow_pack_close (ArioCoverflowPack *pack)
+{
+        /* Images still referencing the mapping keep it alive */
+        if (pack->mapping)
+                g_mapped_file_unref (pack->mapping);
+        if (pack->fd >= 0) {
+                /* The use times no add got to, once the loaders are
+                 * gone */
+                ario_coverflow_pack_flush (pack);
+                close (pack->fd);
+        }
+        g_ptr_array_free (pack->touched, TRUE);
+        g_hash_table_destroy (pack->entries);
+        g_mutex_free (pack->lock);
+        g_free (pack->filename);
+        g_free (pack);
+}
+
+ArioCoverflowImage *
+ario_coverflow_pack_lookup (ArioCoverflowPack *pack,
+                            const gchar *key,
+                            gint64 mtime,
+                            gint size)
+{
+        ArioCoverflowImage *image = NULL;
+        PackEntry *entry;
+
+        g_mutex_lock (pack->lock);
+
+        entry = g_hash_table_lookup (pack->entries, key);
+        if (entry && entry->mtime == mtime && entry->size == size) {
+                /* Records appended since the last mapping need a remap */
+                if (entry->offset + entry->length <= pack->mapped_length
+                    || ario_coverflow_pack_remap (pack)) {
+                        image = ario_coverflow_image_new_mapped (pack->mapping,
+                                                                 entry->data_offset,
+                                                                 entry->size,
+                                                                 entry->n_levels);
+                }
+
+                /* For the next sessions too, but without a write for
+                 * each look, and by the next add */
+                entry->used = g_get_real_time () / G_USEC_PER_SEC;
+                if (entry->used - entry->stored_used >= USED_RESOLUTION && !entry->touched) {
+                        entry->touched = TRUE;
+                        g_ptr_array_add (pack->touched, (gpointer) entry->key);
+                }
+        }
+
+        g_mutex_unlock (pack->lock);
+
+        return image;
+}
+
+void
+ario_coverflow_pack_add (ArioCoverflowPack *pack,
+                         const gchar *key,
+                         gint64 mtime,
+                         ArioCoverflowImage *image)
+{
+        static const gchar padding[PACK_ALIGN];
+        RecordHeader record;
+        PackEntry *entry;
+        gsize key_length = strlen (key);
+        gsize head_length, length, offset;
+        gboolean success;
+
+        if (key_length == 0 || key_length > PACK_MAX_KEY)
+                return;
+
+        g_mutex_lock (pack->lock);
+
+        if (pack->compact_pending && !pack->compacting) {
+                pack->compact_pending = FALSE;
+                ario_coverflow_pack_compact (pack, pack->compact_live);
+        }
+        if (!pack->compacting)
+                ario_coverflow_pack_flush (pack);
+
+        entry = g_hash_table_lookup (pack->entries, key);
+        if (entry && entry->mtime == mtime && entry->size == image->size) {
+                g_mutex_unlock (pack->lock);
+                return;
+        }
+
+        /* Room is made once the budget is reached, but the file never
+         * grows past it */
+        head_length = ALIGN (sizeof (record) + key_length);
+        length = head_length + ALIGN (image->length);
+        if (!pack->compacting && !pack->full && pack->end + length > pack->budget) {
+                if (pack->evict && length <= pack->budget - COMPACT_TARGET (pack->budget))
+                        ario_coverflow_pack_compact (pack, COMPACT_TARGET (pack->budget));
+                else if (!pack->evict && pack->dead > 0)
+                        ario_coverflow_pack_compact (pack, G_MAXSIZE);
+                entry = g_hash_table_lookup (pack->entries, key);
+        }
+        if (pack->compacting || pack->end + length > pack->budget) {
+                if (!pack->evict && !pack->compacting && !pack->full) {
+                        ARIO_LOG_DBG ("%s is full", pack->filename);
+                        pack->full = TRUE;
+                }
+                g_mutex_unlock (pack->lock);
+                return;
+        }
+
+        memset (&record, 0, sizeof (record));
+        record.magic = RECORD_MAGIC;
+        record.key_length = key_length;
+        record.mtime = mtime;
+        record.size = image->size;
+        record.n_levels = image->n_levels;
+        record.data_length = image->length;
+        record.used = g_get_real_time () / G_USEC_PER_SEC;
+
+        offset = pack->end;
+        success = pwrite (pack->fd, &record, sizeof (record), offset) == sizeof (record)
+                && pwrite (pack->fd, key, key_length, offset + sizeof (record)) == (ssize_t) key_length
+                && pwrite (pack->fd, padding, head_length - sizeof (record) - key_length,
+                           offset + sizeof (record) + key_length) == (ssize_t) (head_length - sizeof (record) - key_length)
+                && pwrite (pack->fd, image->pixels, image->length, offset + head_length) == (ssize_t) image->length
+                && pwrite (pack->fd, padding, ALIGN (image->length) - image->length,
+                           offset + head_length + image->length) == (ssize_t) (ALIGN (image->length) - image->length);
+
+        if (!success) {
+                ARIO_LOG_DBG ("Can't write to %s", pack->filename);
+                if (ftruncate (pack->fd, offset) != 0)
+                        ARIO_LOG_DBG ("Can't truncate %s", pack->filename);
+                g_mutex_unlock (pack->lock);
+                return;
+        }
+
+        if (entry)
+                pack->dead += entry->length;
+
+        entry = g_new0 (PackEntry, 1);
+        entry->key = g_intern_string (key);
+        entry->offset = offset;
+        entry->length = head_length + ALIGN (image->length);
+        entry->data_offset = offset + head_length;
+        entry->mtime = mtime;
+        entry->size = image->size;
+        entry->n_levels = image->n_levels;
+        entry->used = entry->stored_used = record.used;
+        g_hash_table_insert (pack->entries, (gpointer) entry->key, entry);
+        pack->end = offset + entry->length;
+
+        g_mutex_unlock (pack->lock);
+}
+
+gboolean
+ario_coverflow_pack_is_full (ArioCoverflowPack *pack)
+{
+        gboolean full;
+
+        g_mutex_lock (pack->lock);
+        full = pack->full;
+        g_mutex_unlock (pack->lock);
+
+        return full;
+}
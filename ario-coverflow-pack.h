@@ -0,0 +1,57 @@
+/*
+ *  Copyright (C) 2011 - Quentin Stievenart <quentin.stievenart@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef __ARIO_COVERFLOW_PACK_H
+#define __ARIO_COVERFLOW_PACK_H
+
+#include <glib.h>
+#include "ario-coverflow-image.h"
+
+G_BEGIN_DECLS
+
+/* On-disk cache of upload-ready covers: a single memory-mapped file of
+ * records, each one keyed by the cover key and the mtime of the file it
+ * was made from. The file stays within budget bytes: if evict, the least
+ * recently used records are evicted to make room, else the pack is full
+ * once only dead records can be dropped. All the functions can be
+ * called from any thread. */
+typedef struct ArioCoverflowPack ArioCoverflowPack;
+
+ArioCoverflowPack *     ario_coverflow_pack_open        (const gchar *filename,
+                                                         gsize budget,
+                                                         gboolean evict);
+
+void                    ario_coverflow_pack_close       (ArioCoverflowPack *pack);
+
+ArioCoverflowImage *    ario_coverflow_pack_lookup      (ArioCoverflowPack *pack,
+                                                         const gchar *key,
+                                                         gint64 mtime,
+                                                         gint size);
+
+void                    ario_coverflow_pack_add         (ArioCoverflowPack *pack,
+                                                         const gchar *key,
+                                                         gint64 mtime,
+                                                         ArioCoverflowImage *image);
+
+/* Whether records are no longer added */
+gboolean                ario_coverflow_pack_is_full     (ArioCoverflowPack *pack);
+
+G_END_DECLS
+
+#endif /* __ARIO_COVERFLOW_PACK_H */
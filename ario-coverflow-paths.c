@@ -0,0 +1,532 @@
+/*
+ *  Copyright (C) 2011 - Quentin Stievenart <quentin.stievenart@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "ario-coverflow-paths.h"
+#include <glib/gstdio.h>
+#include <config.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <errno.h>
+#include <unistd.h>
+#endif
+
+#include "ario-debug.h"
+#include "covers/ario-cover.h"
+
+#define RESCAN_INTERVAL G_USEC_PER_SEC /* between checks of an unwatched directory */
+#define SCAN_BUDGET 4000 /* us of directory scan per idle */
+#ifdef __linux__
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_TO \
+                      | IN_DELETE | IN_MOVED_FROM | IN_DELETE_SELF | IN_MOVE_SELF)
+#endif
+
+typedef struct
+{
+        gint64 mtime;
+        goffset size;
+} CoverFile;
+
+typedef struct
+{
+        gchar *path;
+        GHashTable *files; /* name -> CoverFile */
+        gint wd;           /* inotify watch, -1 when polled */
+        gint64 mtime;      /* of the directory, when polled */
+        gint64 last_check;
+
+        /* A scan runs in the idle, a slice at a time, into
+         * scan_files. Until it is done, files is what was known
+         * before, plus the files looked up meanwhile */
+        GDir *scan;
+        GHashTable *scan_files;
+
+        /* Name -> GSList of the keys of the albums using it */
+        GHashTable *keys;
+} CoverDir;
+
+typedef struct
+{
+        gchar *path;
+        gchar *name;
+        CoverDir *dir;
+} AlbumPath;
+
+struct ArioCoverflowPaths
+{
+        /* Key -> AlbumPath, whether the file exists or not: a missing
+         * cover is one whose name is not in the files of its
+         * directory */
+        GHashTable *albums;
+
+        /* Path -> CoverDir, in practice only the covers directory */
+        GHashTable *dirs;
+
+        gint inotify_fd;
+        guint inotify_source;
+        GHashTable *watches; /* wd -> CoverDir */
+
+        guint scan_source;
+
+        /* Keys whose cover file changed, notified in the idle */
+        ArioCoverflowPathsFunc func;
+        gpointer data;
+        GHashTable *changed;
+        guint notify_source;
+};
+
+static void
+cover_dir_free (CoverDir *dir)
+{
+        if (dir->scan)
+                g_dir_close (dir->scan);
+        g_free (dir->path);
+        g_hash_table_destroy (dir->files);
+        g_hash_table_destroy (dir->scan_files);
+        g_hash_table_destroy (dir->keys);
+        g_slice_free (CoverDir, dir);
+}
+
+static void
+album_path_free (AlbumPath *album)
+{
+        g_free (album->path);
+        g_free (album->name);
+        g_slice_free (AlbumPath, album);
+}
+
+static void
+cover_file_free (CoverFile *file)
+{
+        g_slice_free (CoverFile, file);
+}
+
+/* Reads the state of one file into an index of its directory */
+static void
+stat_file (CoverDir *dir,
+           GHashTable *files,
+           const gchar *name)
+{
+        CoverFile *file;
+        gchar *path;
+        struct stat st;
+
+        path = g_build_filename (dir->path, name, NULL);
+        if (g_stat (path, &st) == 0 && S_ISREG (st.st_mode)) {
+                file = g_slice_new (CoverFile);
+                file->mtime = st.st_mtime;
+                file->size = st.st_size;
+                g_hash_table_replace (files, g_strdup (name), file);
+        } else {
+                g_hash_table_remove (files, name);
+        }
+        g_free (path);
+}
+
+static gboolean
+same_file (const CoverFile *a,
+           const CoverFile *b)
+{
+        if (a == NULL || b == NULL)
+                return a == b;
+        return a->mtime == b->mtime && a->size == b->size;
+}
+
+static gboolean
+notify_idle (gpointer data)
+{
+        ArioCoverflowPaths *paths = (ArioCoverflowPaths *) data;
+        GHashTable *changed = paths->changed;
+        GHashTableIter iter;
+        gpointer key;
+
+        /* The callback may look covers up again */
+        paths->notify_source = 0;
+        paths->changed = g_hash_table_new (g_direct_hash, g_direct_equal);
+        g_hash_table_iter_init (&iter, changed);
+        while (g_hash_table_iter_next (&iter, &key, NULL))
+                paths->func (key, paths->data);
+        g_hash_table_destroy (changed);
+
+        return FALSE;
+}
+
+/* The albums using the file, if any, are notified */
+static void
+file_changed (ArioCoverflowPaths *paths,
+              CoverDir *dir,
+              const gchar *name)
+{
+        GSList *keys;
+
+        if (paths->func == NULL)
+                return;
+
+        for (keys = g_hash_table_lookup (dir->keys, name); keys; keys = keys->next)
+                g_hash_table_insert (paths->changed, keys->data, keys->data);
+        if (g_hash_table_size (paths->changed) > 0 && paths->notify_source == 0)
+                paths->notify_source = g_idle_add (notify_idle, paths);
+}
+
+/* Every file of the directory is gone */
+static void
+clear_dir (ArioCoverflowPaths *paths,
+           CoverDir *dir)
+{
+        GHashTableIter iter;
+        gpointer name;
+
+        g_hash_table_iter_init (&iter, dir->files);
+        while (g_hash_table_iter_next (&iter, &name, NULL))
+                file_changed (paths, dir, name);
+        g_hash_table_remove_all (dir->files);
+}
+
+/* A file seen to change, also for the scan running, if any, which
+ * may have passed it. Returns whether it differs from the index */
+static gboolean
+update_file (CoverDir *dir,
+             const gchar *name)
+{
+        CoverFile *file, before;
+        gboolean existed;
+
+        file = g_hash_table_lookup (dir->files, name);
+        existed = file != NULL;
+        if (existed)
+                before = *file;
+
+        stat_file (dir, dir->files, name);
+        if (dir->scan)
+                stat_file (dir, dir->scan_files, name);
+
+        return !same_file (existed ? &before : NULL, g_hash_table_lookup (dir->files, name));
+}
+
+static void
+watch_dir (ArioCoverflowPaths *paths,
+           CoverDir *dir)
+{
+#ifdef __linux__
+        if (paths->inotify_fd < 0 || dir->wd >= 0)
+                return;
+
+        /* Fails while the directory does not exist, it is polled
+         * until then */
+        dir->wd = inotify_add_watch (paths->inotify_fd, dir->path, WATCH_EVENTS);
+        if (dir->wd >= 0)
+                g_hash_table_insert (paths->watches, GINT_TO_POINTER (dir->wd), dir);
+#endif
+}
+
+static void
+finish_scan (ArioCoverflowPaths *paths,
+             CoverDir *dir)
+{
+        GHashTableIter iter;
+        GHashTable *files;
+        gpointer name, file;
+
+        if (dir->scan)
+                g_dir_close (dir->scan);
+        dir->scan = NULL;
+
+        /* What changed while nothing watched it */
+        g_hash_table_iter_init (&iter, dir->scan_files);
+        while (g_hash_table_iter_next (&iter, &name, &file)) {
+                if (!same_file (file, g_hash_table_lookup (dir->files, name)))
+                        file_changed (paths, dir, name);
+        }
+        g_hash_table_iter_init (&iter, dir->files);
+        while (g_hash_table_iter_next (&iter, &name, NULL)) {
+                if (!g_hash_table_lookup (dir->scan_files, name))
+                        file_changed (paths, dir, name);
+        }
+
+        files = dir->files;
+        dir->files = dir->scan_files;
+        dir->scan_files = files;
+        g_hash_table_remove_all (dir->scan_files);
+
+        ARIO_LOG_DBG ("%d files in %s", g_hash_table_size (dir->files), dir->path);
+}
+
+/* Stats the files of the directories being scanned for SCAN_BUDGET */
+static gboolean
+scan_idle (gpointer data)
+{
+        ArioCoverflowPaths *paths = (ArioCoverflowPaths *) data;
+        gint64 deadline = g_get_monotonic_time () + SCAN_BUDGET;
+        GHashTableIter iter;
+        const gchar *name;
+        gboolean scanning = FALSE;
+        CoverDir *dir;
+
+        g_hash_table_iter_init (&iter, paths->dirs);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &dir)) {
+                if (dir->scan == NULL)
+                        continue;
+                do {
+                        name = g_dir_read_name (dir->scan);
+                        if (name)
+                                stat_file (dir, dir->scan_files, name);
+                } while (name && g_get_monotonic_time () < deadline);
+                if (name)
+                        scanning = TRUE;
+                else
+                        finish_scan (paths, dir);
+        }
+
+        if (!scanning)
+                paths->scan_source = 0;
+        return scanning;
+}
+
+/* The whole directory, once, the stats done here are the last ones
+ * while it is watched. They are spread over idles, a large covers
+ * directory would stall the first scroll else */
+static void
+scan_dir (ArioCoverflowPaths *paths,
+          CoverDir *dir)
+{
+        struct stat st;
+
+        /* Watched first, so nothing written during the scan is
+         * missed */
+        watch_dir (paths, dir);
+        dir->last_check = g_get_monotonic_time ();
+        dir->mtime = g_stat (dir->path, &st) == 0 ? st.st_mtime : 0;
+
+        if (dir->scan)
+                g_dir_close (dir->scan);
+        g_hash_table_remove_all (dir->scan_files);
+        dir->scan = g_dir_open (dir->path, 0, NULL);
+        if (dir->scan == NULL) {
+                finish_scan (paths, dir);
+                return;
+        }
+
+        if (paths->scan_source == 0)
+                paths->scan_source = g_idle_add_full (G_PRIORITY_LOW, scan_idle, paths, NULL);
+}
+
+/* Without a watch, a directory is scanned again when its mtime
+ * changes: files added, removed or renamed, not rewritten in place */
+static void
+poll_dir (ArioCoverflowPaths *paths,
+          CoverDir *dir)
+{
+        gint64 now = g_get_monotonic_time ();
+        struct stat st;
+
+        if (dir->wd >= 0 || now - dir->last_check < RESCAN_INTERVAL)
+                return;
+
+        dir->last_check = now;
+        if (g_stat (dir->path, &st) != 0) {
+                clear_dir (paths, dir);
+                dir->mtime = 0;
+        } else if (st.st_mtime != dir->mtime) {
+                scan_dir (paths, dir);
+        }
+}
+
+#ifdef __linux__
+static void
+rescan_all (ArioCoverflowPaths *paths)
+{
+        GHashTableIter iter;
+        gpointer dir;
+
+        g_hash_table_iter_init (&iter, paths->dirs);
+        while (g_hash_table_iter_next (&iter, NULL, &dir))
+                scan_dir (paths, dir);
+}
+
+static gboolean
+inotify_cb (GIOChannel *source,
+            GIOCondition condition,
+            gpointer data)
+{
+        ArioCoverflowPaths *paths = (ArioCoverflowPaths *) data;
+        gchar buffer[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+        const struct inotify_event *event;
+        GHashTableIter iter;
+        CoverDir *dir;
+        gssize length;
+        gchar *p;
+
+        while ((length = read (paths->inotify_fd, buffer, sizeof (buffer))) > 0) {
+                for (p = buffer; p < buffer + length; p += sizeof (*event) + event->len) {
+                        event = (const struct inotify_event *) p;
+                        if (event->mask & IN_Q_OVERFLOW) {
+                                ARIO_LOG_DBG ("Cover events lost, rescanning");
+                                rescan_all (paths);
+                                continue;
+                        }
+
+                        dir = g_hash_table_lookup (paths->watches, GINT_TO_POINTER (event->wd));
+                        if (dir == NULL)
+                                continue;
+
+                        /* The directory itself went away: polled
+                         * until it comes back */
+                        if (event->mask & IN_MOVE_SELF) {
+                                inotify_rm_watch (paths->inotify_fd, event->wd);
+                        } else if (event->mask & IN_IGNORED) {
+                                g_hash_table_remove (paths->watches, GINT_TO_POINTER (event->wd));
+                                dir->wd = -1;
+                                dir->last_check = 0;
+                                clear_dir (paths, dir);
+                        } else if (event->len > 0 && update_file (dir, event->name)) {
+                                file_changed (paths, dir, event->name);
+                        }
+                }
+        }
+        if (length < 0 && errno != EAGAIN && errno != EINTR) {
+                ARIO_LOG_DBG ("Can't read cover events, polling from now on");
+                close (paths->inotify_fd);
+                paths->inotify_fd = -1;
+                paths->inotify_source = 0;
+                g_hash_table_iter_init (&iter, paths->watches);
+                while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &dir))
+                        dir->wd = -1;
+                g_hash_table_remove_all (paths->watches);
+                rescan_all (paths);
+                return FALSE;
+        }
+
+        return TRUE;
+}
+#endif
+
+ArioCoverflowPaths *
+ario_coverflow_paths_new (ArioCoverflowPathsFunc func,
+                          gpointer data)
+{
+        ArioCoverflowPaths *paths;
+#ifdef __linux__
+        GIOChannel *channel;
+#endif
+
+        paths = g_new0 (ArioCoverflowPaths, 1);
+        paths->albums = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                               NULL, (GDestroyNotify) album_path_free);
+        paths->dirs = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             NULL, (GDestroyNotify) cover_dir_free);
+        paths->watches = g_hash_table_new (g_direct_hash, g_direct_equal);
+        paths->func = func;
+        paths->data = data;
+        paths->changed = g_hash_table_new (g_direct_hash, g_direct_equal);
+        paths->inotify_fd = -1;
+#ifdef __linux__
+        paths->inotify_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+        if (paths->inotify_fd >= 0) {
+                channel = g_io_channel_unix_new (paths->inotify_fd);
+                paths->inotify_source = g_io_add_watch (channel, G_IO_IN, inotify_cb, paths);
+                g_io_channel_unref (channel);
+        } else {
+                ARIO_LOG_DBG ("No inotify, cover directories are polled");
+        }
+#endif
+
+        return paths;
+}
+
+void
+ario_coverflow_paths_free (ArioCoverflowPaths *paths)
+{
+        if (paths->scan_source)
+                g_source_remove (paths->scan_source);
+        if (paths->notify_source)
+                g_source_remove (paths->notify_source);
+        if (paths->inotify_source)
+                g_source_remove (paths->inotify_source);
+#ifdef __linux__
+        if (paths->inotify_fd >= 0)
+                close (paths->inotify_fd);
+#endif
+        g_hash_table_destroy (paths->albums);
+        g_hash_table_destroy (paths->watches);
+        g_hash_table_destroy (paths->dirs);
+        g_hash_table_destroy (paths->changed);
+        g_free (paths);
+}
+
+const gchar *
+ario_coverflow_paths_lookup (ArioCoverflowPaths *paths,
+                             const gchar *key,
+                             const gchar *artist,
+                             const gchar *album,
+                             gint64 *mtime,
+                             goffset *size)
+{
+        AlbumPath *album_path;
+        CoverDir *dir;
+        CoverFile *file;
+        GSList *keys;
+        gchar *dirname;
+
+        /* The path only depends on the names, it is made once */
+        album_path = g_hash_table_lookup (paths->albums, key);
+        if (album_path == NULL) {
+                album_path = g_slice_new (AlbumPath);
+                album_path->path = ario_cover_make_cover_path (artist, album, NORMAL_COVER);
+                album_path->name = g_path_get_basename (album_path->path);
+                dirname = g_path_get_dirname (album_path->path);
+                dir = g_hash_table_lookup (paths->dirs, dirname);
+                if (dir == NULL) {
+                        dir = g_slice_new0 (CoverDir);
+                        dir->path = dirname;
+                        dir->files = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                            g_free, (GDestroyNotify) cover_file_free);
+                        dir->scan_files = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                                 g_free, (GDestroyNotify) cover_file_free);
+                        dir->keys = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                           g_free, (GDestroyNotify) g_slist_free);
+                        dir->wd = -1;
+                        g_hash_table_insert (paths->dirs, dir->path, dir);
+                        scan_dir (paths, dir);
+                } else {
+                        g_free (dirname);
+                }
+                album_path->dir = dir;
+                g_hash_table_insert (paths->albums, (gpointer) key, album_path);
+
+                /* Inserted after the head, which the table holds */
+                keys = g_hash_table_lookup (dir->keys, album_path->name);
+                if (keys)
+                        g_slist_insert (keys, (gpointer) key, 1);
+                else
+                        g_hash_table_insert (dir->keys, g_strdup (album_path->name),
+                                             g_slist_prepend (NULL, (gpointer) key));
+        }
+
+        /* Not scanned yet: stat'ed alone, as without the index */
+        dir = album_path->dir;
+        poll_dir (paths, dir);
+        if (dir->scan && !g_hash_table_lookup (dir->files, album_path->name))
+                update_file (dir, album_path->name);
+        file = g_hash_table_lookup (dir->files, album_path->name);
+        if (file == NULL)
+                return NULL;
+
+        *mtime = file->mtime;
+        *size = file->size;
+        return album_path->path;
+}
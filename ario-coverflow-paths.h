@@ -0,0 +1,58 @@
+/*
+ *  Copyright (C) 2011 - Quentin Stievenart <quentin.stievenart@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef __ARIO_COVERFLOW_PATHS_H
+#define __ARIO_COVERFLOW_PATHS_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* In-memory index of the cover files: the path of each album, made
+ * once, and the files of the covers directory with their mtime and
+ * size, read by a single scan of it, spread over idles. Until it is
+ * done, the covers looked up are stat'ed one at a time. Missing covers
+ * are answered from the index too. It is kept current with inotify
+ * where there is one, else by rescanning a directory when its mtime
+ * changes, looked at once a second at most. Keys are interned strings,
+ * compared by address. Main thread only. */
+typedef struct ArioCoverflowPaths ArioCoverflowPaths;
+
+/* Called from the idle for each album looked up before whose cover
+ * file was added, rewritten or removed since */
+typedef void (*ArioCoverflowPathsFunc) (const gchar *key,
+                                        gpointer data);
+
+ArioCoverflowPaths *    ario_coverflow_paths_new        (ArioCoverflowPathsFunc func,
+                                                         gpointer data);
+
+void                    ario_coverflow_paths_free       (ArioCoverflowPaths *paths);
+
+/* The cover file of an album, owned by the index, or NULL when it has
+ * none. mtime and size are set when found */
+const gchar *           ario_coverflow_paths_lookup     (ArioCoverflowPaths *paths,
+                                                         const gchar *key,
+                                                         const gchar *artist,
+                                                         const gchar *album,
+                                                         gint64 *mtime,
+                                                         goffset *size);
+
+G_END_DECLS
+
+#endif /* __ARIO_COVERFLOW_PATHS_H */
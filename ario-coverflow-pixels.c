@@ -0,0 +1,362 @@
+/*
+ *  Copyright (C) 2011 Quentin Stievenart <quentin.stievenart@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "ario-coverflow-pixels.h"
+#include <string.h>
+#include <config.h>
+
+#include "ario-debug.h"
+
+/* The SIMD kernels are built with per function target attributes, so
+ * the plugin still runs on CPUs without them */
+#if (defined (__x86_64__) || defined (__i386__)) && (__GNUC__ >= 5 || defined (__clang__))
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+/* Converts width pixels of a row */
+typedef void (*RowFunc) (const guchar *src, guchar *dst, gint width);
+
+typedef struct
+{
+        const gchar *name;
+        RowFunc rgb;                    /* RGB -> BGRA */
+        RowFunc rgba;                   /* RGBA -> BGRA */
+        RowFunc rgba_premultiply;       /* RGBA -> premultiplied BGRA */
+} Kernels;
+
+/* x / 255, exact for x <= 255 * 255 */
+#define DIV255(x) ((((x) + 128) + (((x) + 128) >> 8)) >> 8)
+
+static guint32
+load32 (const guchar *p)
+{
+        guint32 value;
+
+        memcpy (&value, p, sizeof (value));
+        return value;
+}
+
+static void
+rgb_row_scalar (const guchar *src, guchar *dst, gint width)
+{
+        gint x;
+
+        for (x = 0; x < width; x++) {
+                dst[0] = src[2];
+                dst[1] = src[1];
+                dst[2] = src[0];
+                dst[3] = 0xff;
+                src += 3;
+                dst += 4;
+        }
+}
+
+static void
+rgba_row_scalar (const guchar *src, guchar *dst, gint width)
+{
+        gint x;
+
+        for (x = 0; x < width; x++) {
+                dst[0] = src[2];
+                dst[1] = src[1];
+                dst[2] = src[0];
+                dst[3] = src[3];
+                src += 4;
+                dst += 4;
+        }
+}
+
+static void
+rgba_premultiply_row_scalar (const guchar *src, guchar *dst, gint width)
+{
+        guint alpha;
+        gint x;
+
+        for (x = 0; x < width; x++) {
+                alpha = src[3];
+                dst[0] = DIV255 (src[2] * alpha);
+                dst[1] = DIV255 (src[1] * alpha);
+                dst[2] = DIV255 (src[0] * alpha);
+                dst[3] = alpha;
+                src += 4;
+                dst += 4;
+        }
+}
+
+static const Kernels scalar_kernels = {
+        "scalar",
+        rgb_row_scalar,
+        rgba_row_scalar,
+        rgba_premultiply_row_scalar
+};
+
+#ifdef HAVE_X86_KERNELS
+
+/* SSE2 has no byte shuffle: R and B are swapped with shifts */
+__attribute__ ((target ("sse2"))) static __m128i
+swap_rb_sse2 (__m128i pixels)
+{
+        __m128i ag = _mm_and_si128 (pixels, _mm_set1_epi32 ((gint) 0xff00ff00));
+        __m128i rb = _mm_and_si128 (pixels, _mm_set1_epi32 (0x00ff00ff));
+
+        rb = _mm_or_si128 (_mm_srli_epi32 (rb, 16), _mm_slli_epi32 (rb, 16));
+        return _mm_or_si128 (ag, rb);
+}
+
+/* Multiplies B, G and R by A, on BGRA pixels */
+__attribute__ ((target ("sse2"))) static __m128i
+premultiply_sse2 (__m128i pixels)
+{
+        const __m128i zero = _mm_setzero_si128 ();
+        const __m128i color_mask = _mm_set_epi16 (0, -1, -1, -1, 0, -1, -1, -1);
+        const __m128i alpha_one = _mm_set_epi16 (255, 0, 0, 0, 255, 0, 0, 0);
+        const __m128i round = _mm_set1_epi16 (128);
+        __m128i halves[2], alpha;
+        int i;
+
+        halves[0] = _mm_unpacklo_epi8 (pixels, zero);
+        halves[1] = _mm_unpackhi_epi8 (pixels, zero);
+        for (i = 0; i < 2; i++) {
+                alpha = _mm_shufflelo_epi16 (halves[i], _MM_SHUFFLE (3, 3, 3, 3));
+                alpha = _mm_shufflehi_epi16 (alpha, _MM_SHUFFLE (3, 3, 3, 3));
+                alpha = _mm_or_si128 (_mm_and_si128 (alpha, color_mask), alpha_one);
+                halves[i] = _mm_add_epi16 (_mm_mullo_epi16 (halves[i], alpha), round);
+                halves[i] = _mm_srli_epi16 (_mm_add_epi16 (halves[i], _mm_srli_epi16 (halves[i], 8)), 8);
+        }
+        return _mm_packus_epi16 (halves[0], halves[1]);
+}
+
+__attribute__ ((target ("sse2"))) static void
+rgb_row_sse2 (const guchar *src, guchar *dst, gint width)
+{
+        const __m128i opaque = _mm_set1_epi32 ((gint) 0xff000000);
+        __m128i pixels;
+        gint x;
+
+        /* Each pixel is read as 4 bytes, so one more must follow */
+        for (x = 0; x + 5 <= width; x += 4) {
+                pixels = _mm_set_epi32 (load32 (src + 9), load32 (src + 6),
+                                        load32 (src + 3), load32 (src));
+                pixels = _mm_or_si128 (swap_rb_sse2 (pixels), opaque);
+                _mm_storeu_si128 ((__m128i *) dst, pixels);
+                src += 12;
+                dst += 16;
+        }
+        rgb_row_scalar (src, dst, width - x);
+}
+
+__attribute__ ((target ("sse2"))) static void
+rgba_row_sse2 (const guchar *src, guchar *dst, gint width)
+{
+        __m128i pixels;
+        gint x;
+
+        for (x = 0; x + 4 <= width; x += 4) {
+                pixels = _mm_loadu_si128 ((const __m128i *) src);
+                _mm_storeu_si128 ((__m128i *) dst, swap_rb_sse2 (pixels));
+                src += 16;
+                dst += 16;
+        }
+        rgba_row_scalar (src, dst, width - x);
+}
+
+__attribute__ ((target ("sse2"))) static void
+rgba_premultiply_row_sse2 (const guchar *src, guchar *dst, gint width)
+{
+        __m128i pixels;
+        gint x;
+
+        for (x = 0; x + 4 <= width; x += 4) {
+                pixels = _mm_loadu_si128 ((const __m128i *) src);
+                pixels = premultiply_sse2 (swap_rb_sse2 (pixels));
+                _mm_storeu_si128 ((__m128i *) dst, pixels);
+                src += 16;
+                dst += 16;
+        }
+        rgba_premultiply_row_scalar (src, dst, width - x);
+}
+
+static const Kernels sse2_kernels = {
+        "sse2",
+        rgb_row_sse2,
+        rgba_row_sse2,
+        rgba_premultiply_row_sse2
+};
+
+__attribute__ ((target ("avx2"))) static __m256i
+swap_rb_avx2 (__m256i pixels)
+{
+        const __m256i order = _mm256_setr_epi8 (2, 1, 0, 3, 6, 5, 4, 7,
+                                                10, 9, 8, 11, 14, 13, 12, 15,
+                                                2, 1, 0, 3, 6, 5, 4, 7,
+                                                10, 9, 8, 11, 14, 13, 12, 15);
+
+        return _mm256_shuffle_epi8 (pixels, order);
+}
+
+__attribute__ ((target ("avx2"))) static __m256i
+premultiply_avx2 (__m256i pixels)
+{
+        const __m256i zero = _mm256_setzero_si256 ();
+        const __m256i color_mask = _mm256_set_epi16 (0, -1, -1, -1, 0, -1, -1, -1,
+                                                     0, -1, -1, -1, 0, -1, -1, -1);
+        const __m256i alpha_one = _mm256_set_epi16 (255, 0, 0, 0, 255, 0, 0, 0,
+                                                    255, 0, 0, 0, 255, 0, 0, 0);
+        const __m256i round = _mm256_set1_epi16 (128);
+        __m256i halves[2], alpha;
+        int i;
+
+        /* Unpack and pack both work within 128 bit lanes, so the pixel
+         * order is kept */
+        halves[0] = _mm256_unpacklo_epi8 (pixels, zero);
+        halves[1] = _mm256_unpackhi_epi8 (pixels, zero);
+        for (i = 0; i < 2; i++) {
+                alpha = _mm256_shufflelo_epi16 (halves[i], _MM_SHUFFLE (3, 3, 3, 3));
+                alpha = _mm256_shufflehi_epi16 (alpha, _MM_SHUFFLE (3, 3, 3, 3));
+                alpha = _mm256_or_si256 (_mm256_and_si256 (alpha, color_mask), alpha_one);
+                halves[i] = _mm256_add_epi16 (_mm256_mullo_epi16 (halves[i], alpha), round);
+                halves[i] = _mm256_srli_epi16 (_mm256_add_epi16 (halves[i], _mm256_srli_epi16 (halves[i], 8)), 8);
+        }
+        return _mm256_packus_epi16 (halves[0], halves[1]);
+}
+
+__attribute__ ((target ("avx2"))) static void
+rgb_row_avx2 (const guchar *src, guchar *dst, gint width)
+{
+        /* Pixels 0-3 go to the low lane and 4-7 to the high one, each
+         * 12 bytes expanded to 16 */
+        const __m256i spread = _mm256_setr_epi32 (0, 1, 2, 3, 3, 4, 5, 6);
+        const __m256i order = _mm256_setr_epi8 (2, 1, 0, -128, 5, 4, 3, -128,
+                                                8, 7, 6, -128, 11, 10, 9, -128,
+                                                2, 1, 0, -128, 5, 4, 3, -128,
+                                                8, 7, 6, -128, 11, 10, 9, -128);
+        const __m256i opaque = _mm256_set1_epi32 ((gint) 0xff000000);
+        __m256i pixels;
+        gint x;
+
+        /* 8 pixels are 24 bytes, but 32 are read */
+        for (x = 0; x + 11 <= width; x += 8) {
+                pixels = _mm256_loadu_si256 ((const __m256i *) src);
+                pixels = _mm256_permutevar8x32_epi32 (pixels, spread);
+                pixels = _mm256_or_si256 (_mm256_shuffle_epi8 (pixels, order), opaque);
+                _mm256_storeu_si256 ((__m256i *) dst, pixels);
+                src += 24;
+                dst += 32;
+        }
+        rgb_row_sse2 (src, dst, width - x);
+}
+
+__attribute__ ((target ("avx2"))) static void
+rgba_row_avx2 (const guchar *src, guchar *dst, gint width)
+{
+        __m256i pixels;
+        gint x;
+
+        for (x = 0; x + 8 <= width; x += 8) {
+                pixels = _mm256_loadu_si256 ((const __m256i *) src);
+                _mm256_storeu_si256 ((__m256i *) dst, swap_rb_avx2 (pixels));
+                src += 32;
+                dst += 32;
+        }
+        rgba_row_scalar (src, dst, width - x);
+}
+
+__attribute__ ((target ("avx2"))) static void
+rgba_premultiply_row_avx2 (const guchar *src, guchar *dst, gint width)
+{
+        __m256i pixels;
+        gint x;
+
+        for (x = 0; x + 8 <= width; x += 8) {
+                pixels = _mm256_loadu_si256 ((const __m256i *) src);
+                pixels = premultiply_avx2 (swap_rb_avx2 (pixels));
+                _mm256_storeu_si256 ((__m256i *) dst, pixels);
+                src += 32;
+                dst += 32;
+        }
+        rgba_premultiply_row_scalar (src, dst, width - x);
+}
+
+static const Kernels avx2_kernels = {
+        "avx2",
+        rgb_row_avx2,
+        rgba_row_avx2,
+        rgba_premultiply_row_avx2
+};
+
+#endif /* HAVE_X86_KERNELS */
+
+static const Kernels *
+ario_coverflow_pixels_get_kernels (void)
+{
+        static gsize kernels = 0;
+        const Kernels *chosen = &scalar_kernels;
+
+        /* Called from the loader threads */
+        if (g_once_init_enter (&kernels)) {
+#ifdef HAVE_X86_KERNELS
+                __builtin_cpu_init ();
+                if (__builtin_cpu_supports ("avx2"))
+                        chosen = &avx2_kernels;
+                else if (__builtin_cpu_supports ("sse2"))
+                        chosen = &sse2_kernels;
+#endif
+                ARIO_LOG_DBG ("Using %s pixel conversion", chosen->name);
+                g_once_init_leave (&kernels, (gsize) chosen);
+        }
+
+        return (const Kernels *) kernels;
+}
+
+void
+ario_coverflow_pixels_to_bgra (const guchar *src,
+                               gint src_stride,
+                               gint src_channels,
+                               gint width,
+                               gint height,
+                               guchar *dst,
+                               ArioCoverflowPixelsFlags flags)
+{
+        const Kernels *kernels = ario_coverflow_pixels_get_kernels ();
+        RowFunc row;
+        gint y, dst_y;
+
+        g_return_if_fail (src_channels == 3 || src_channels == 4);
+
+        if (src_channels == 3)
+                row = kernels->rgb;
+        else if (flags & ARIO_COVERFLOW_PIXELS_PREMULTIPLY)
+                row = kernels->rgba_premultiply;
+        else
+                row = kernels->rgba;
+
+        for (y = 0; y < height; y++) {
+                dst_y = (flags & ARIO_COVERFLOW_PIXELS_FLIP) ? height - 1 - y : y;
+                row (src + (gsize) y * src_stride,
+                     dst + (gsize) dst_y * width * 4,
+                     width);
+        }
+}
+
+const gchar *
+ario_coverflow_pixels_kernels (void)
+{
+        return ario_coverflow_pixels_get_kernels ()->name;
+}
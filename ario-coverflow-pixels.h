@@ -0,0 +1,49 @@
+/*
+ *  Copyright (C) 2011 - Quentin Stievenart <quentin.stievenart@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef __ARIO_COVERFLOW_PIXELS_H
+#define __ARIO_COVERFLOW_PIXELS_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum
+{
+        ARIO_COVERFLOW_PIXELS_PREMULTIPLY = 1 << 0,
+        ARIO_COVERFLOW_PIXELS_FLIP = 1 << 1     /* last row first */
+} ArioCoverflowPixelsFlags;
+
+/* Converts RGB or RGBA rows with any stride to tightly packed BGRA, the
+ * layout drivers take as is with GL_BGRA and
+ * GL_UNSIGNED_INT_8_8_8_8_REV. RGB gets an opaque alpha. The SSE2 or
+ * AVX2 kernels are picked at the first call, from what the CPU has */
+void                    ario_coverflow_pixels_to_bgra   (const guchar *src,
+                                                         gint src_stride,
+                                                         gint src_channels,
+                                                         gint width,
+                                                         gint height,
+                                                         guchar *dst,
+                                                         ArioCoverflowPixelsFlags flags);
+
+const gchar *           ario_coverflow_pixels_kernels   (void);
+
+G_END_DECLS
+
+#endif /* __ARIO_COVERFLOW_PIXELS_H */
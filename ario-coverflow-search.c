@@ -0,0 +1,237 @@
+/*
+ *  Copyright (C) 2011 Quentin Stievenart <quentin.stievenart@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "ario-coverflow-search.h"
+#include <string.h>
+#include <config.h>
+
+#include "ario-debug.h"
+
+typedef struct
+{
+        const gchar *folded;    /* interned */
+        const gchar *key;
+} SearchEntry;
+
+struct ArioCoverflowSearch
+{
+        /* Both sorted by folded name, then by key */
+        GArray *artists;
+        GArray *albums;
+};
+
+static gint
+ario_coverflow_search_compare (gconstpointer a,
+                               gconstpointer b)
+{
+        const SearchEntry *entry_a = a;
+        const SearchEntry *entry_b = b;
+        gint ret;
+
+        ret = strcmp (entry_a->folded, entry_b->folded);
+        if (ret == 0)
+                ret = strcmp (entry_a->key, entry_b->key);
+        return ret;
+}
+
+gchar *
+ario_coverflow_search_fold (const gchar *str)
+{
+        GString *stripped;
+        gchar *decomposed, *folded;
+        const gchar *tmp;
+        gunichar c;
+
+        /* Decompose, so that accents become separate marks we can drop */
+        decomposed = g_utf8_normalize (str, -1, G_NORMALIZE_NFD);
+        if (decomposed == NULL)
+                return g_strdup ("");
+
+        stripped = g_string_sized_new (strlen (decomposed));
+        for (tmp = decomposed; *tmp; tmp = g_utf8_next_char (tmp)) {
+                c = g_utf8_get_char (tmp);
+                if (!g_unichar_ismark (c))
+                        g_string_append_unichar (stripped, c);
+        }
+        g_free (decomposed);
+
+        folded = g_utf8_casefold (stripped->str, stripped->len);
+        g_string_free (stripped, TRUE);
+
+        return folded;
+}
+
+static const gchar *
+ario_coverflow_search_intern_folded (const gchar *str)
+{
+        const gchar *interned;
+        gchar *folded;
+
+        folded = ario_coverflow_search_fold (str);
+        interned = g_intern_string (folded);
+        g_free (folded);
+
+        return interned;
+}
+
+/* Merges sorted entries into a sorted array in a single pass */
+static GArray *
+ario_coverflow_search_merge (GArray *array,
+                             GArray *entries)
+{
+        GArray *merged;
+        guint i = 0, j = 0;
+
+        g_array_sort (entries, ario_coverflow_search_compare);
+
+        merged = g_array_sized_new (FALSE, FALSE, sizeof (SearchEntry),
+                                    array->len + entries->len);
+        while (i < array->len || j < entries->len) {
+                if (j >= entries->len
+                    || (i < array->len
+                        && ario_coverflow_search_compare (&g_array_index (array, SearchEntry, i),
+                                                          &g_array_index (entries, SearchEntry, j)) <= 0)) {
+                        g_array_append_val (merged, g_array_index (array, SearchEntry, i));
+                        i++;
+                } else {
+                        g_array_append_val (merged, g_array_index (entries, SearchEntry, j));
+                        j++;
+                }
+        }
+
+        g_array_free (array, TRUE);
+        return merged;
+}
+
+static void
+ario_coverflow_search_filter (GArray *array,
+                              GHashTable *keys)
+{
+        SearchEntry *entry;
+        guint i, kept = 0;
+
+        for (i = 0; i < array->len; i++) {
+                entry = &g_array_index (array, SearchEntry, i);
+                if (!g_hash_table_lookup (keys, entry->key))
+                        g_array_index (array, SearchEntry, kept++) = *entry;
+        }
+        g_array_set_size (array, kept);
+}
+
+/* First entry whose folded name starts with prefix */
+static const SearchEntry *
+ario_coverflow_search_find (GArray *array,
+                            const gchar *prefix)
+{
+        const SearchEntry *entry;
+        gsize length = strlen (prefix);
+        guint low = 0, high = array->len, middle;
+
+        while (low < high) {
+                middle = low + (high - low) / 2;
+                if (strcmp (g_array_index (array, SearchEntry, middle).folded, prefix) < 0)
+                        low = middle + 1;
+                else
+                        high = middle;
+        }
+
+        if (low == array->len)
+                return NULL;
+        entry = &g_array_index (array, SearchEntry, low);
+        return strncmp (entry->folded, prefix, length) == 0 ? entry : NULL;
+}
+
+ArioCoverflowSearch *
+ario_coverflow_search_new (void)
+{
+        ArioCoverflowSearch *search;
+
+        search = g_new0 (ArioCoverflowSearch, 1);
+        search->artists = g_array_new (FALSE, FALSE, sizeof (SearchEntry));
+        search->albums = g_array_new (FALSE, FALSE, sizeof (SearchEntry));
+
+        return search;
+}
+
+void
+ario_coverflow_search_free (ArioCoverflowSearch *search)
+{
+        g_array_free (search->artists, TRUE);
+        g_array_free (search->albums, TRUE);
+        g_free (search);
+}
+
+void
+ario_coverflow_search_add (ArioCoverflowSearch *search,
+                           const ArioCoverflowAlbum *albums,
+                           gint n_albums)
+{
+        GArray *artists, *titles;
+        SearchEntry entry;
+        const gchar *last_artist = NULL;
+        const gchar *last_folded = NULL;
+        gint i;
+
+        artists = g_array_sized_new (FALSE, FALSE, sizeof (SearchEntry), n_albums);
+        titles = g_array_sized_new (FALSE, FALSE, sizeof (SearchEntry), n_albums);
+
+        for (i = 0; i < n_albums; i++) {
+                /* Albums of an artist usually follow each other */
+                if (albums[i].artist != last_artist) {
+                        last_artist = albums[i].artist;
+                        last_folded = ario_coverflow_search_intern_folded (last_artist);
+                }
+                entry.key = albums[i].key;
+                entry.folded = last_folded;
+                g_array_append_val (artists, entry);
+
+                entry.folded = ario_coverflow_search_intern_folded (albums[i].album);
+                g_array_append_val (titles, entry);
+        }
+
+        search->artists = ario_coverflow_search_merge (search->artists, artists);
+        search->albums = ario_coverflow_search_merge (search->albums, titles);
+        g_array_free (artists, TRUE);
+        g_array_free (titles, TRUE);
+}
+
+void
+ario_coverflow_search_remove (ArioCoverflowSearch *search,
+                              GHashTable *keys)
+{
+        ario_coverflow_search_filter (search->artists, keys);
+        ario_coverflow_search_filter (search->albums, keys);
+}
+
+const gchar *
+ario_coverflow_search_lookup (ArioCoverflowSearch *search,
+                              const gchar *prefix)
+{
+        const SearchEntry *entry;
+        gchar *folded;
+
+        /* Artists first, as that is how the albums are ordered */
+        folded = ario_coverflow_search_fold (prefix);
+        entry = ario_coverflow_search_find (search->artists, folded);
+        if (entry == NULL)
+                entry = ario_coverflow_search_find (search->albums, folded);
+        g_free (folded);
+
+        return entry ? entry->key : NULL;
+}
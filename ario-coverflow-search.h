@@ -0,0 +1,50 @@
+/*
+ *  Copyright (C) 2011 - Quentin Stievenart <quentin.stievenart@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef __ARIO_COVERFLOW_SEARCH_H
+#define __ARIO_COVERFLOW_SEARCH_H
+
+#include <glib.h>
+#include "ario-coverflow-albums.h"
+
+G_BEGIN_DECLS
+
+/* Sorted prefix arrays over the case and diacritic folded artist and
+ * album names, resolving a typed prefix to an album key */
+typedef struct ArioCoverflowSearch ArioCoverflowSearch;
+
+ArioCoverflowSearch *   ario_coverflow_search_new       (void);
+
+void                    ario_coverflow_search_free      (ArioCoverflowSearch *search);
+
+void                    ario_coverflow_search_add       (ArioCoverflowSearch *search,
+                                                         const ArioCoverflowAlbum *albums,
+                                                         gint n_albums);
+
+void                    ario_coverflow_search_remove    (ArioCoverflowSearch *search,
+                                                         GHashTable *keys);
+
+const gchar *           ario_coverflow_search_lookup    (ArioCoverflowSearch *search,
+                                                         const gchar *prefix);
+
+gchar *                 ario_coverflow_search_fold      (const gchar *str);
+
+G_END_DECLS
+
+#endif /* __ARIO_COVERFLOW_SEARCH_H */
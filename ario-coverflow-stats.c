@@ -0,0 +1,250 @@
+/*
+ *  Copyright (C) 2011 - Quentin Stievenart <quentin.stievenart@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "ario-coverflow-stats.h"
+#include <config.h>
+
+#include "ario-debug.h"
+
+/* Histograms of durations in us: 4 buckets per power of two, from 0
+ * to 2^31 */
+#define SUB_BUCKETS 4
+#define N_BUCKETS (SUB_BUCKETS * 31)
+
+/* Ends of the last frames, for the frame rate */
+#define N_FRAME_TIMES 128
+
+static const gchar *stage_names[ARIO_COVERFLOW_STATS_N_STAGES] = {
+        "path", "decode", "convert", "upload", "draw", "swap", "frame"
+};
+
+static const gchar *counter_names[ARIO_COVERFLOW_STATS_N_COUNTERS] = {
+        "pack-hits", "pack-misses", "prefetch-hits", "prefetch-misses",
+        "deferred-uploads", "cache-hits", "cache-misses", "cache-evictions",
+        "frame-reuses", "texture-bytes", "buffer-bytes", "cache-bytes"
+};
+
+static struct
+{
+        volatile gint buckets[ARIO_COVERFLOW_STATS_N_STAGES][N_BUCKETS];
+        volatile gint counts[ARIO_COVERFLOW_STATS_N_STAGES];
+        volatile gint max[ARIO_COVERFLOW_STATS_N_STAGES];
+        volatile gint counters[ARIO_COVERFLOW_STATS_N_COUNTERS];
+
+        /* Frames are only drawn from the main thread */
+        gint64 frame_times[N_FRAME_TIMES];
+        gint next_frame;
+} stats;
+
+static gint
+bucket_of (guint us)
+{
+        gint e;
+
+        if (us < SUB_BUCKETS)
+                return us;
+
+        /* The leading bit gives the power of two, the next two bits
+         * the quarter within it */
+        e = g_bit_storage (us) - 1;
+        return MIN (SUB_BUCKETS * (e - 1) + ((us >> (e - 2)) & (SUB_BUCKETS - 1)),
+                    N_BUCKETS - 1);
+}
+
+static gdouble
+bucket_start (gint bucket)
+{
+        if (bucket < SUB_BUCKETS)
+                return bucket;
+
+        return (gdouble) (SUB_BUCKETS + bucket % SUB_BUCKETS) * (1u << (bucket / SUB_BUCKETS - 1));
+}
+
+gint64
+ario_coverflow_stats_time (ArioCoverflowStatsStage stage,
+                           gint64 start)
+{
+        gint64 now = ario_coverflow_stats_now ();
+        gint us = CLAMP (now - start, 0, G_MAXINT);
+        gint max;
+
+        g_atomic_int_add (&stats.buckets[stage][bucket_of (us)], 1);
+        g_atomic_int_add (&stats.counts[stage], 1);
+        do {
+                max = g_atomic_int_get (&stats.max[stage]);
+        } while (us > max && !g_atomic_int_compare_and_exchange (&stats.max[stage], max, us));
+
+        if (stage == ARIO_COVERFLOW_STATS_FRAME) {
+                stats.frame_times[stats.next_frame] = now;
+                stats.next_frame = (stats.next_frame + 1) % N_FRAME_TIMES;
+        }
+
+        return now;
+}
+
+void
+ario_coverflow_stats_count (ArioCoverflowStatsCounter counter,
+                            gint n)
+{
+        g_atomic_int_add (&stats.counters[counter], n);
+}
+
+void
+ario_coverflow_stats_set (ArioCoverflowStatsCounter counter,
+                          gint value)
+{
+        g_atomic_int_set (&stats.counters[counter], value);
+}
+
+gdouble
+ario_coverflow_stats_percentile (ArioCoverflowStatsStage stage,
+                                 gdouble p)
+{
+        gint count = g_atomic_int_get (&stats.counts[stage]);
+        gint bucket, n, seen = 0;
+
+        if (count == 0)
+                return 0;
+
+        /* Middle of the bucket the rank falls in */
+        for (bucket = 0; bucket < N_BUCKETS; bucket++) {
+                n = g_atomic_int_get (&stats.buckets[stage][bucket]);
+                seen += n;
+                if (n > 0 && seen > p * (count - 1))
+                        break;
+        }
+        if (bucket == N_BUCKETS)
+                bucket--;
+
+        return (bucket_start (bucket) + bucket_start (bucket + 1)) / 2000.0;
+}
+
+gint
+ario_coverflow_stats_fps (void)
+{
+        gint64 since = ario_coverflow_stats_now () - G_USEC_PER_SEC;
+        gint i, fps = 0;
+
+        for (i = 0; i < N_FRAME_TIMES; i++) {
+                if (stats.frame_times[i] > since)
+                        fps++;
+        }
+
+        return fps;
+}
+
+static gint
+hit_rate (ArioCoverflowStatsCounter hits,
+          ArioCoverflowStatsCounter misses)
+{
+        gint n_hits = g_atomic_int_get (&stats.counters[hits]);
+        gint n_misses = g_atomic_int_get (&stats.counters[misses]);
+
+        return n_hits + n_misses > 0 ? 100 * (gint64) n_hits / (n_hits + n_misses) : 0;
+}
+
+gchar *
+ario_coverflow_stats_summary (void)
+{
+        GString *summary;
+        gint stage;
+
+        summary = g_string_new (NULL);
+        g_string_append_printf (summary, "%d fps\n", ario_coverflow_stats_fps ());
+        for (stage = 0; stage < ARIO_COVERFLOW_STATS_N_STAGES; stage++) {
+                g_string_append_printf (summary, "%-8s p50 %7.2f  p99 %7.2f  max %7.2f ms\n",
+                                        stage_names[stage],
+                                        ario_coverflow_stats_percentile (stage, 0.5),
+                                        ario_coverflow_stats_percentile (stage, 0.99),
+                                        g_atomic_int_get (&stats.max[stage]) / 1000.0);
+        }
+        g_string_append_printf (summary, "pack %d%%  prefetch %d%%  deferred %d  reused %d\n",
+                                hit_rate (ARIO_COVERFLOW_STATS_PACK_HITS,
+                                          ARIO_COVERFLOW_STATS_PACK_MISSES),
+                                hit_rate (ARIO_COVERFLOW_STATS_PREFETCH_HITS,
+                                          ARIO_COVERFLOW_STATS_PREFETCH_MISSES),
+                                g_atomic_int_get (&stats.counters[ARIO_COVERFLOW_STATS_DEFERRED_UPLOADS]),
+                                g_atomic_int_get (&stats.counters[ARIO_COVERFLOW_STATS_FRAME_REUSES]));
+        g_string_append_printf (summary, "cache %d%%  %.1f MB  evicted %d\n",
+                                hit_rate (ARIO_COVERFLOW_STATS_CACHE_HITS,
+                                          ARIO_COVERFLOW_STATS_CACHE_MISSES),
+                                g_atomic_int_get (&stats.counters[ARIO_COVERFLOW_STATS_CACHE_BYTES]) / 1048576.0,
+                                g_atomic_int_get (&stats.counters[ARIO_COVERFLOW_STATS_CACHE_EVICTIONS]));
+        g_string_append_printf (summary, "textures %.1f MB  buffers %.1f MB",
+                                g_atomic_int_get (&stats.counters[ARIO_COVERFLOW_STATS_TEXTURE_BYTES]) / 1048576.0,
+                                g_atomic_int_get (&stats.counters[ARIO_COVERFLOW_STATS_BUFFER_BYTES]) / 1048576.0);
+
+        return g_string_free (summary, FALSE);
+}
+
+gboolean
+ario_coverflow_stats_dump (const gchar *filename,
+                           GError **error)
+{
+        GString *dump;
+        gchar *summary;
+        gint stage, counter, bucket, n;
+        gboolean ret;
+
+        summary = ario_coverflow_stats_summary ();
+        dump = g_string_new (summary);
+        g_free (summary);
+
+        g_string_append (dump, "\n\n");
+        for (counter = 0; counter < ARIO_COVERFLOW_STATS_N_COUNTERS; counter++) {
+                g_string_append_printf (dump, "%s %d\n", counter_names[counter],
+                                        g_atomic_int_get (&stats.counters[counter]));
+        }
+
+        /* One line per non empty bucket: stage, lower bound in us,
+         * count */
+        for (stage = 0; stage < ARIO_COVERFLOW_STATS_N_STAGES; stage++) {
+                g_string_append_printf (dump, "\n%s %d\n", stage_names[stage],
+                                        g_atomic_int_get (&stats.counts[stage]));
+                for (bucket = 0; bucket < N_BUCKETS; bucket++) {
+                        n = g_atomic_int_get (&stats.buckets[stage][bucket]);
+                        if (n > 0)
+                                g_string_append_printf (dump, "%s %.0f %d\n", stage_names[stage],
+                                                        bucket_start (bucket), n);
+                }
+        }
+
+        ret = g_file_set_contents (filename, dump->str, dump->len, error);
+        g_string_free (dump, TRUE);
+        ARIO_LOG_DBG ("Stats written to %s", filename);
+
+        return ret;
+}
+
+void
+ario_coverflow_stats_reset (void)
+{
+        gint stage, counter, bucket;
+
+        for (stage = 0; stage < ARIO_COVERFLOW_STATS_N_STAGES; stage++) {
+                for (bucket = 0; bucket < N_BUCKETS; bucket++)
+                        g_atomic_int_set (&stats.buckets[stage][bucket], 0);
+                g_atomic_int_set (&stats.counts[stage], 0);
+                g_atomic_int_set (&stats.max[stage], 0);
+        }
+
+        /* The sizes stay, they are set once */
+        for (counter = 0; counter < ARIO_COVERFLOW_STATS_TEXTURE_BYTES; counter++)
+                g_atomic_int_set (&stats.counters[counter], 0);
+}
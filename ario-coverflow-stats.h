@@ -0,0 +1,93 @@
+/*
+ *  Copyright (C) 2011 - Quentin Stievenart <quentin.stievenart@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef __ARIO_COVERFLOW_STATS_H
+#define __ARIO_COVERFLOW_STATS_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Stages of the path from an album to the screen, each timed into its
+ * own histogram */
+typedef enum
+{
+        ARIO_COVERFLOW_STATS_PATH,      /* cover path and stat */
+        ARIO_COVERFLOW_STATS_DECODE,    /* file to scaled pixbuf */
+        ARIO_COVERFLOW_STATS_CONVERT,   /* pixbuf to BGRA and mips */
+        ARIO_COVERFLOW_STATS_UPLOAD,
+        ARIO_COVERFLOW_STATS_DRAW,
+        ARIO_COVERFLOW_STATS_SWAP,
+        ARIO_COVERFLOW_STATS_FRAME,     /* a whole draw */
+        ARIO_COVERFLOW_STATS_N_STAGES
+} ArioCoverflowStatsStage;
+
+typedef enum
+{
+        ARIO_COVERFLOW_STATS_PACK_HITS,
+        ARIO_COVERFLOW_STATS_PACK_MISSES,
+        ARIO_COVERFLOW_STATS_PREFETCH_HITS,
+        ARIO_COVERFLOW_STATS_PREFETCH_MISSES,
+        ARIO_COVERFLOW_STATS_DEFERRED_UPLOADS,
+        ARIO_COVERFLOW_STATS_CACHE_HITS,
+        ARIO_COVERFLOW_STATS_CACHE_MISSES,
+        ARIO_COVERFLOW_STATS_CACHE_EVICTIONS,
+        ARIO_COVERFLOW_STATS_FRAME_REUSES,      /* exposes that only blit */
+        ARIO_COVERFLOW_STATS_TEXTURE_BYTES,     /* set, not counted */
+        ARIO_COVERFLOW_STATS_BUFFER_BYTES,      /* set, not counted */
+        ARIO_COVERFLOW_STATS_CACHE_BYTES,       /* set, not counted */
+        ARIO_COVERFLOW_STATS_N_COUNTERS
+} ArioCoverflowStatsCounter;
+
+/* All of these can be called from any thread, they only use atomic
+ * operations */
+
+#define ario_coverflow_stats_now() g_get_monotonic_time ()
+
+/* Records the time since start, in us, and returns the current time,
+ * to start the next stage with */
+gint64                  ario_coverflow_stats_time       (ArioCoverflowStatsStage stage,
+                                                         gint64 start);
+
+void                    ario_coverflow_stats_count      (ArioCoverflowStatsCounter counter,
+                                                         gint n);
+
+void                    ario_coverflow_stats_set        (ArioCoverflowStatsCounter counter,
+                                                         gint value);
+
+/* In ms, with a 25% resolution */
+gdouble                 ario_coverflow_stats_percentile (ArioCoverflowStatsStage stage,
+                                                         gdouble p);
+
+/* Frames drawn in the last second */
+gint                    ario_coverflow_stats_fps        (void);
+
+/* A few lines for the overlay */
+gchar *                 ario_coverflow_stats_summary    (void);
+
+/* The summary and the full histograms */
+gboolean                ario_coverflow_stats_dump       (const gchar *filename,
+                                                         GError **error);
+
+/* Clears the timings and counts, not the sizes */
+void                    ario_coverflow_stats_reset      (void);
+
+G_END_DECLS
+
+#endif /* __ARIO_COVERFLOW_STATS_H */
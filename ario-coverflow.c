@@ -18,11 +18,21 @@
  */
 
 #include "ario-coverflow.h"
+#include "ario-coverflow-albums.h"
+#include "ario-coverflow-cache.h"
+#include "ario-coverflow-loader.h"
+#include "ario-coverflow-paths.h"
+#include "ario-coverflow-search.h"
+#include "ario-coverflow-stats.h"
+#include "ario-coverflow-shaders.h" /* generated from shader.vert and shader.frag */
 #include <GL/glew.h>
 #include <GL/glut.h>
 #include <gtk/gtk.h>
 #include <gtk/gtkgl.h>
+#include <gdk/gdkkeysyms.h>
+#include <glib/gstdio.h>
 #include <string.h>
+#include <math.h>
 #include <config.h>
 #include <glib/gi18n.h>
 
@@ -38,11 +48,58 @@
 
 #define LIST_SQUARE 1
 #define N_COVERS 7
+#define MIN_COVER_SIZE 64
+#define MAX_COVER_SIZE 512 /* the atlas is 4 covers wide */
+#define SLOT(position) ((position) % N_COVERS)
+
+#define PREF_COVERFLOW_PREFETCH_DEPTH "coverflow-prefetch-depth"
+#define PREF_COVERFLOW_PREFETCH_DEPTH_DEFAULT 16
+#define PREF_COVERFLOW_COVER_SIZE "coverflow-cover-size"
+#define PREF_COVERFLOW_COVER_SIZE_DEFAULT 256
+#define PREF_COVERFLOW_SMOOTH_COVERS "coverflow-smooth-covers"
+#define PREF_COVERFLOW_SMOOTH_COVERS_DEFAULT TRUE
+#define PREF_COVERFLOW_CACHE_SIZE "coverflow-cache-size"
+#define PREF_COVERFLOW_CACHE_SIZE_DEFAULT 64 /* MB */
+#define PREF_COVERFLOW_CACHE_COMPRESS "coverflow-cache-compress"
+#define PREF_COVERFLOW_CACHE_COMPRESS_DEFAULT FALSE
+#define PREF_COVERFLOW_SCRUB_SPEED "coverflow-scrub-speed"
+#define PREF_COVERFLOW_SCRUB_SPEED_DEFAULT 15 /* albums per second, 0 never scrubs */
+#define PREF_COVERFLOW_RETAINED_SIZE "coverflow-retained-size"
+#define PREF_COVERFLOW_RETAINED_SIZE_DEFAULT 16 /* MB kept while not shown */
+#define PREF_COVERFLOW_PACK_SIZE "coverflow-pack-size"
+#define PREF_COVERFLOW_PACK_SIZE_DEFAULT 512 /* MB on disk */
+#define PREF_COVERFLOW_THUMBS_SIZE "coverflow-thumbs-size"
+#define PREF_COVERFLOW_THUMBS_SIZE_DEFAULT 64 /* MB on disk, about 40000 albums */
 #define ANGLE 45
 #define SCALE_FACTOR 1.3
 #define SHIFT_GREAT_COVER 0.3
 #define SHIFT_COVERS 0.7
 #define SHIFT_BETWEEN_COVERS 0.3
+#define FRAME_INTERVAL 16 /* ms, about the display rate */
+#define SCROLL_DURATION 150000 /* us, time for one step of the slide */
+#define PREFETCH_BEHIND 2 /* covers kept behind the window */
+#define PREFETCH_LOOKAHEAD 0.5 /* s of scrolling prefetched ahead */
+#define SCROLL_IDLE 500000 /* us without scroll before speed is reset */
+#define TYPEAHEAD_TIMEOUT 1000000 /* us between keys of a type-ahead search */
+#define PAGE_BUDGET 8000 /* us of album requests per idle */
+#define SEARCH_BATCH 512 /* albums indexed at once while the list loads */
+#define FOVY 60
+#define Z_NEAR 1
+#define Z_FAR 1000
+#define EYE_DISTANCE 2
+#define N_LAYERS (N_COVERS + 1) /* the slots, then the placeholder */
+#define PLACEHOLDER_LAYER N_COVERS
+#define ATLAS_COLUMNS 4 /* cells of the fixed pipeline atlas, */
+#define ATLAS_ROWS 2    /* powers of two holding N_LAYERS */
+#define MAX_ANISOTROPY 8
+#define UPLOAD_REGIONS 3 /* covers in flight in the upload ring */
+#define SIDE_LOD_BIAS 1.0 /* side covers sample one level coarser */
+#define STATS_LINE_HEIGHT 15 /* px, of GLUT_BITMAP_9_BY_15 */
+#define SHADER_CACHE_MAGIC 0x41435031 /* "ACP1", before the binary format */
+#define THUMB_SIZE 16
+#define THUMB_BATCH 4 /* thumbnails the builder has decoded at once */
+#define THUMB_BUILD_PRIORITY 1000 /* after the ones scrubbed over */
+#define SCRUB_SETTLE 150 /* ms without scroll before full covers are loaded */
 #define INVALID_SHADER 0 /* should absolutely be 0 */
 #define INVALID_PROGRAM 0 /* should absolutely be 0 */
 
@@ -70,21 +127,117 @@ static gboolean button_press_event (GtkWidget *widget,
 static gboolean scroll_event (GtkWidget *widget,
                               GdkEventScroll *event,
                               gpointer data);
-static gboolean idle (gpointer data);
+static gboolean key_press_event (GtkWidget *widget,
+                                 GdkEventKey *event,
+                                 gpointer data);
+static gboolean visibility_notify_event (GtkWidget *widget,
+                                         GdkEventVisibility *event,
+                                         gpointer data);
+static void unmap (GtkWidget *widget, gpointer data);
+static void unrealize (GtkWidget *widget, gpointer data);
+
+static void init_view (ArioCoverflow *coverflow);
+static void init_model (ArioCoverflow *coverflow);
+static gboolean load_albums_page (ArioCoverflow *coverflow, gint min_albums);
+static gboolean load_albums_idle (gpointer data);
+static void apply_reload (ArioCoverflow *coverflow);
+static void dbtime_changed_cb (ArioServer *server,
+                               ArioCoverflow *coverflow);
+static void move_to (ArioCoverflow *coverflow, gint position);
+static void queue_redraw (ArioCoverflow *coverflow);
+static void start_animation (ArioCoverflow *coverflow);
+static void stop_animation (ArioCoverflow *coverflow);
+static gboolean frame_tick (gpointer data);
+static void apply_scroll (ArioCoverflow *coverflow);
+static gboolean scroll_idle (gpointer data);
+static gboolean scrub_settle (gpointer data);
+static void load_thumb (ArioCoverflow *coverflow,
+                        int slot,
+                        ArioCoverflowAlbum *album);
+static void thumb_loaded (const gchar *key,
+                          gint64 mtime,
+                          ArioCoverflowImage *image,
+                          gpointer data);
+static void build_thumbs (ArioCoverflow *coverflow);
+static gboolean build_thumbs_idle (gpointer data);
+
+/* One cover of the frame, as uploaded to the instance buffer */
+typedef struct
+{
+        GLfloat model[16];
+        GLfloat layer;
+        GLfloat lod_bias;
+} CoverInstance;
+
+typedef struct
+{
+        CoverInstance covers[N_COVERS];
+        gint n_covers;
+        gboolean covers_pass; /* else the thumbnails one */
+} CoverInstances;
+
+/* Attribute locations, matching shader.vert */
+enum
+{
+        ATTRIB_POSITION = 0,
+        ATTRIB_TEXCOORD = 1,
+        ATTRIB_MODEL = 2, /* 4 columns: 2 to 5 */
+        ATTRIB_LAYER = 6,
+        ATTRIB_LOD_BIAS = 7
+};
+
+G_STATIC_ASSERT (ATLAS_COLUMNS * ATLAS_ROWS >= N_LAYERS);
 
 static gboolean draw (ArioCoverflow *coverflow);
 static void draw_square (void);
 static void draw_albums (ArioCoverflow *coverflow);
+static void draw_albums_instanced (ArioCoverflow *coverflow);
+static void draw_instances (ArioCoverflow *coverflow,
+                            gboolean covers_pass);
+static void draw_stats (ArioCoverflow *coverflow);
+static void dump_stats (ArioCoverflow *coverflow);
 
 static void allocate_textures (ArioCoverflow *coverflow);
-static void load_texture (ArioServerAlbum *album);
+static void load_texture (ArioCoverflow *coverflow,
+                          int slot,
+                          ArioCoverflowAlbum *album);
+static void request_cover (ArioCoverflow *coverflow,
+                           ArioCoverflowAlbum *album,
+                           const gchar *key,
+                           gint priority);
+static void texture_loaded (const gchar *key,
+                            gint64 mtime,
+                            ArioCoverflowImage *image,
+                            gpointer data);
+static gboolean upload_texture (ArioCoverflow *coverflow,
+                                int slot,
+                                ArioCoverflowImage *image);
+static gboolean upload_pending (ArioCoverflow *coverflow);
+static void upload_thumb (ArioCoverflow *coverflow,
+                          int slot,
+                          ArioCoverflowImage *image);
+static void upload_slots (ArioCoverflow *coverflow);
+static void prefetch (ArioCoverflow *coverflow);
+static void unref_image (gpointer image);
+static void cover_file_changed (const gchar *key,
+                                gpointer data);
+static void release_resources (ArioCoverflow *coverflow);
 
 static void gl_init_lights(void);
 static void gl_init_textures(ArioCoverflow *coverflow);
-#ifdef ARIO_COVERFLOW_USE_SHADERS
-static void gl_init_shaders (ArioCoverflow *coverflow);
-static GLuint load_shader (GLenum shader_type, gchar *filename);
-#endif
+static void gl_resize_frame (ArioCoverflow *coverflow,
+                             gint width,
+                             gint height);
+static void gl_free_frame (ArioCoverflow *coverflow);
+static void gl_free_covers (ArioCoverflow *coverflow);
+static void gl_free_thumbs (ArioCoverflow *coverflow);
+static gsize gl_layers_length (gint cover_size);
+static void gl_init_upload_ring (ArioCoverflow *coverflow);
+static gboolean gl_init_shaders (ArioCoverflow *coverflow);
+static void gl_init_buffers (ArioCoverflow *coverflow);
+static GLuint load_shader (GLenum shader_type,
+                           const gchar *source,
+                           const gchar *defines);
 
 struct ArioCoverflowPrivate
 {
@@ -92,15 +245,133 @@ struct ArioCoverflowPrivate
 
         GtkUIManager *ui_manager;
 
+        /* Empty until the first select, see init_view */
+        GtkWidget *scrolledwindow;
         GtkWidget *error_label;
         GtkWidget *drawing_area;
+        gboolean view_initialized;
+
+        ArioCoverflowAlbums *albums;
+        ArioCoverflowSearch *search;
+        gint position;
+
+        /* The album list is fetched one artist at a time, in the idle,
+         * into loading. The first time, that is the shown list, which
+         * grows as it goes. After a database update it is a new one,
+         * diffed against the shown list when complete. Albums from
+         * n_indexed on are not in the search index yet */
+        ArioCoverflowAlbums *loading;
+        GSList *pending_artists;
+        guint page_source;
+        gint n_indexed;
+
+        /* Modification time of the cover files, by key, as seen when
+         * they were requested, 0 when there was none. Kept for the
+         * covers in decoded and the ones being decoded */
+        GHashTable *cover_mtimes; /* key -> gint64 */
+
+        /* Where the cover files are, and which are missing */
+        ArioCoverflowPaths *paths;
+
+        /* Type-ahead search being typed */
+        GString *typeahead;
+        gint64 last_key;
+
+        /* Ring of texture slots: the album at position p lives in slot
+         * SLOT(p), so a one-step scroll only replaces one slot. Slots
+         * are layers of an array texture, or cells of an atlas in the
+         * fixed pipeline, so every cover is drawn from a single bind */
+        GLuint covers;
+        gint cover_size; /* power of two */
+
+        /* Upload ring: a persistently mapped pixel buffer cut in
+         * regions of one cover, each reused once the GPU has read it.
+         * When it is full, uploads wait for the next frame */
+        GLuint upload_buffer;
+        guchar *upload_map;
+        gsize upload_region_size;
+        GLsync upload_fences[UPLOAD_REGIONS];
+        gint upload_next;
+        gboolean upload_deferred;
+        guint64 bytes_uploaded;
+
+        /* Key of the cover each texture slot holds or waits for, and
+         * whether it has been uploaded yet */
+        const gchar *slot_keys[N_COVERS];
+        gboolean slot_loaded[N_COVERS];
+        ArioCoverflowLoader *loader;
+        ArioCoverflowPack *pack;
+
+        /* Thumbnails: a pack of tiny covers for the whole list, drawn
+         * from their own texture while scrubbing (scrolling faster
+         * than the scrub speed) and until the cover of a slot is
+         * uploaded. The pack is filled by the loader from the covers
+         * it decodes, and by a builder in the idle, until it is full:
+         * thumbs_next is the next album it checks, -1 until the list
+         * is loaded */
+        ArioCoverflowPack *thumbs;
+        ArioCoverflowLoader *thumb_loader;
+        GLuint thumb_covers;
+        const gchar *thumb_keys[N_COVERS];
+        ArioCoverflowImage *thumb_images[N_COVERS]; /* to upload */
+        gboolean thumb_loaded[N_COVERS];
+        gboolean scrubbing;
+        guint scrub_source;
+        gint thumbs_next;
+        gint thumbs_in_flight;
+        guint thumbs_source;
+
+        /* Decoded covers around the window, by key. Albums without a
+         * cover are stored with a NULL image */
+        GHashTable *decoded;
+
+        /* Decoded covers dropped from the window, for when the view
+         * comes back to them */
+        ArioCoverflowCache *cache;
+
+        /* Prefetch requests still wanted, and the recent scroll
+         * direction (+1 / -1) and speed in albums per second */
+        GHashTable *prefetching;
+        gint scroll_direction;
+        gfloat scroll_speed;
+        gint64 last_scroll;
+
+        /* Scroll steps received but not applied yet: a burst of wheel
+         * events moves once, at the next frame */
+        gint scroll_pending;
+        guint scroll_source;
 
-        GList *album;
-        GLuint textures[N_COVERS];
         GLuint program;
         GLuint vshader, fshader;
 
         gboolean gl_initialized, shader_initialized;
+
+        /* Instanced renderer, used when the driver supports GL 3.3: a
+         * static quad and one instance per cover, drawn in one call */
+        gboolean instanced;
+        GLuint vertex_array;
+        GLuint quad_buffer, instance_buffer;
+        GLint view_projection_location;
+        GLfloat view_projection[16];
+
+        /* Frame scheduling: frames are only drawn on damage, and the
+         * frame timer only runs while the slide animation does */
+        gboolean visible;
+        gfloat offset;
+        guint frame_source;
+        gint64 last_frame;
+
+        /* The last scene drawn, without the overlay, kept in a
+         * framebuffer object: exposes while nothing changed only blit
+         * it. Whatever changes the scene goes through queue_redraw,
+         * which marks it stale */
+        GLuint frame_fbo;
+        GLuint frame_renderbuffers[2]; /* color, depth */
+        gint frame_width, frame_height;
+        gboolean frame_valid;
+
+        /* Overlay of the stage timings, toggled with F12 */
+        gboolean show_stats;
 };
 
 /* Object properties */
@@ -134,11 +405,49 @@ ario_coverflow_get_icon (ArioSource *source)
 static void
 ario_coverflow_select (ArioSource *source)
 {
+        ArioCoverflow *coverflow = ARIO_COVERFLOW (source);
+        ArioCoverflowPrivate *priv = coverflow->priv;
+        GdkGLContext *glcontext;
+        GdkGLDrawable *gldrawable;
+        GtkAllocation allocation;
+
+        if (!priv->view_initialized) {
+                priv->view_initialized = TRUE;
+                init_view (coverflow);
+                return;
+        }
+        if (!priv->gl_initialized || !gtk_widget_get_realized (priv->drawing_area))
+                return;
+
+        /* Back from release_resources: what it freed is made again,
+         * the covers come from the cache or the pack */
+        glcontext = gtk_widget_get_gl_context (priv->drawing_area);
+        gldrawable = gtk_widget_get_gl_drawable (priv->drawing_area);
+        if (!gdk_gl_drawable_gl_begin (gldrawable, glcontext))
+                return;
+        if (priv->covers == 0 || priv->thumb_covers == 0)
+                gl_init_textures (coverflow);
+        gtk_widget_get_allocation (priv->drawing_area, &allocation);
+        gl_resize_frame (coverflow, allocation.width, allocation.height);
+        gdk_gl_drawable_gl_end (gldrawable);
+
+        allocate_textures (coverflow);
+        if (priv->thumbs_next >= 0 && priv->thumbs_source == 0
+            && priv->thumbs_next < ario_coverflow_albums_length (priv->albums))
+                priv->thumbs_source = g_idle_add_full (G_PRIORITY_LOW,
+                                                       build_thumbs_idle,
+                                                       coverflow,
+                                                       NULL);
+        queue_redraw (coverflow);
 }
 
 static void
 ario_coverflow_unselect (ArioSource *source)
 {
+        ArioCoverflow *coverflow = ARIO_COVERFLOW (source);
+
+        if (coverflow->priv->gl_initialized)
+                release_resources (coverflow);
 }
 
 static void
@@ -174,34 +483,320 @@ ario_coverflow_class_init (ArioCoverflowClass *klass)
 }
 
 
+/* Everything but the widgets: the album list, its search index and
+ * the cover pipeline */
 static void
-ario_coverflow_init (ArioCoverflow *coverflow)
+init_model (ArioCoverflow *coverflow)
+{
+        gchar *pack_filename;
+        gint size;
+
+        coverflow->priv->albums = ario_coverflow_albums_new ();
+        coverflow->priv->search = ario_coverflow_search_new ();
+        coverflow->priv->typeahead = g_string_new (NULL);
+
+        /* Covers are downscaled to the power of two at or
+         * above the configured size */
+        size = CLAMP (ario_conf_get_integer (PREF_COVERFLOW_COVER_SIZE,
+                                             PREF_COVERFLOW_COVER_SIZE_DEFAULT),
+                      MIN_COVER_SIZE, MAX_COVER_SIZE);
+        for (coverflow->priv->cover_size = MIN_COVER_SIZE;
+             coverflow->priv->cover_size < size;
+             coverflow->priv->cover_size *= 2);
+
+        /* Covers are decoded by a pool of worker threads, and
+         * kept ready to upload in the pack for the next time, along
+         * with their thumbnail. Both packs are only written from the
+         * worker threads */
+        pack_filename = g_build_filename (ario_util_config_dir (), "coverflow-thumbs.pack", NULL);
+        coverflow->priv->thumbs = ario_coverflow_pack_open (pack_filename,
+                                                            (gsize) MAX (ario_conf_get_integer (PREF_COVERFLOW_THUMBS_SIZE,
+                                                                                                PREF_COVERFLOW_THUMBS_SIZE_DEFAULT), 0) << 20,
+                                                            FALSE);
+        g_free (pack_filename);
+        pack_filename = g_build_filename (ario_util_config_dir (), "coverflow.pack", NULL);
+        coverflow->priv->pack = ario_coverflow_pack_open (pack_filename,
+                                                          (gsize) MAX (ario_conf_get_integer (PREF_COVERFLOW_PACK_SIZE,
+                                                                                              PREF_COVERFLOW_PACK_SIZE_DEFAULT), 0) << 20,
+                                                          TRUE);
+        g_free (pack_filename);
+        coverflow->priv->loader = ario_coverflow_loader_new (coverflow->priv->pack,
+                                                             coverflow->priv->cover_size,
+                                                             ario_conf_get_boolean (PREF_COVERFLOW_SMOOTH_COVERS,
+                                                                                    PREF_COVERFLOW_SMOOTH_COVERS_DEFAULT),
+                                                             coverflow->priv->thumbs,
+                                                             THUMB_SIZE,
+                                                             texture_loaded,
+                                                             coverflow);
+
+        /* Missing thumbnails are decoded at their size, by a loader of
+         * their own */
+        coverflow->priv->thumb_loader = ario_coverflow_loader_new (coverflow->priv->thumbs,
+                                                                   THUMB_SIZE,
+                                                                   FALSE,
+                                                                   NULL,
+                                                                   0,
+                                                                   thumb_loaded,
+                                                                   coverflow);
+        coverflow->priv->thumbs_next = -1;
+        coverflow->priv->decoded = g_hash_table_new_full (g_direct_hash,
+                                                          g_direct_equal,
+                                                          NULL,
+                                                          unref_image);
+        coverflow->priv->prefetching = g_hash_table_new (g_direct_hash,
+                                                         g_direct_equal);
+        coverflow->priv->cover_mtimes = g_hash_table_new_full (g_direct_hash,
+                                                               g_direct_equal,
+                                                               NULL,
+                                                               g_free);
+        coverflow->priv->paths = ario_coverflow_paths_new (cover_file_changed, coverflow);
+        coverflow->priv->cache = ario_coverflow_cache_new ((gsize) MAX (ario_conf_get_integer (PREF_COVERFLOW_CACHE_SIZE,
+                                                                                               PREF_COVERFLOW_CACHE_SIZE_DEFAULT), 0) << 20,
+                                                           ario_conf_get_boolean (PREF_COVERFLOW_CACHE_COMPRESS,
+                                                                                  PREF_COVERFLOW_CACHE_COMPRESS_DEFAULT));
+        coverflow->priv->scroll_direction = 1;
+
+        /* Only the first screenful is waited for */
+        coverflow->priv->loading = coverflow->priv->albums;
+        coverflow->priv->pending_artists = ario_server_list_tags (ARIO_TAG_ARTIST, NULL);
+        if (load_albums_page (coverflow, N_COVERS))
+                coverflow->priv->page_source = g_idle_add_full (G_PRIORITY_LOW,
+                                                                load_albums_idle,
+                                                                coverflow, NULL);
+}
+
+/* Fetches the albums of the next artists, at least min_albums of them
+ * or for PAGE_BUDGET. Albums are only appended, so the position and
+ * the slots stay valid. Returns whether artists are left */
+static gboolean
+load_albums_page (ArioCoverflow *coverflow,
+                  gint min_albums)
+{
+        ArioCoverflowPrivate *priv = coverflow->priv;
+        ArioServerAtomicCriteria atomic_criteria;
+        ArioServerCriteria *criteria = NULL;
+        GList *albums;
+        gchar *artist;
+        gint first = ario_coverflow_albums_length (priv->loading);
+        gint64 deadline = g_get_monotonic_time () + PAGE_BUDGET;
+
+        atomic_criteria.tag = ARIO_TAG_ARTIST;
+        criteria = g_slist_append (criteria, &atomic_criteria);
+        while (priv->pending_artists
+               && (ario_coverflow_albums_length (priv->loading) - first < min_albums
+                   || g_get_monotonic_time () < deadline)) {
+                artist = priv->pending_artists->data;
+                priv->pending_artists = g_slist_delete_link (priv->pending_artists,
+                                                             priv->pending_artists);
+                atomic_criteria.value = artist;
+                albums = ario_server_get_albums (criteria);
+                ario_coverflow_albums_append_list (priv->loading, albums);
+                g_list_foreach (albums, (GFunc) ario_server_free_album, NULL);
+                g_list_free (albums);
+                g_free (artist);
+        }
+        g_slist_free (criteria);
+
+        if (priv->loading != priv->albums) {
+                if (priv->pending_artists == NULL)
+                        apply_reload (coverflow);
+                return priv->pending_artists != NULL;
+        }
+
+        /* Merging into the search index costs the size of the index,
+         * so it is done in batches */
+        if (ario_coverflow_albums_length (priv->albums) - priv->n_indexed >= SEARCH_BATCH
+            || (priv->pending_artists == NULL && ario_coverflow_albums_length (priv->albums) > priv->n_indexed)) {
+                ario_coverflow_search_add (priv->search,
+                                           ario_coverflow_albums_index (priv->albums, priv->n_indexed),
+                                           ario_coverflow_albums_length (priv->albums) - priv->n_indexed);
+                priv->n_indexed = ario_coverflow_albums_length (priv->albums);
+        }
+
+        /* The window may have had empty slots */
+        if (first <= priv->position + N_COVERS/2
+            && ario_coverflow_albums_length (priv->albums) > first) {
+                allocate_textures (coverflow);
+                queue_redraw (coverflow);
+        }
+
+        if (priv->pending_artists == NULL)
+                build_thumbs (coverflow);
+
+        ARIO_LOG_DBG ("%d albums loaded", ario_coverflow_albums_length (priv->albums));
+        return priv->pending_artists != NULL;
+}
+
+static gboolean
+load_albums_idle (gpointer data)
+{
+        ArioCoverflow *coverflow = (ArioCoverflow *) data;
+
+        if (load_albums_page (coverflow, 0))
+                return TRUE;
+
+        coverflow->priv->page_source = 0;
+        return FALSE;
+}
+
+static void
+set_cover_mtime (ArioCoverflow *coverflow,
+                 const gchar *key,
+                 gint64 mtime)
+{
+        g_hash_table_insert (coverflow->priv->cover_mtimes, (gpointer) key,
+                             g_memdup (&mtime, sizeof (mtime)));
+}
+
+static gint64
+get_cover_mtime (ArioCoverflow *coverflow,
+                 const gchar *key)
+{
+        gint64 *mtime = g_hash_table_lookup (coverflow->priv->cover_mtimes, key);
+
+        return mtime ? *mtime : 0;
+}
+
+/* Whether the cover file of an album changed since it was requested */
+static gboolean
+cover_changed (ArioCoverflow *coverflow,
+               const ArioCoverflowAlbum *album)
+{
+        gint64 mtime;
+        goffset size;
+
+        if (!ario_coverflow_paths_lookup (coverflow->priv->paths, album->key,
+                                          album->artist, album->album, &mtime, &size))
+                mtime = 0;
+
+        return get_cover_mtime (coverflow, album->key) != mtime;
+}
+
+/* Swaps the reloaded list in. The album shown stays in the center, or
+ * the nearest one before it that is still there. Textures, decoded
+ * covers and pending requests of the albums kept are reused, unless
+ * their cover file changed */
+static void
+apply_reload (ArioCoverflow *coverflow)
+{
+        ArioCoverflowPrivate *priv = coverflow->priv;
+        ArioCoverflowAlbums *old = priv->albums, *new = priv->loading;
+        ArioCoverflowAlbum *album;
+        GHashTable *removed, *changed;
+        GHashTableIter iter;
+        gpointer key;
+        GArray *added;
+        gint i, old_position, position = -1;
+
+        removed = g_hash_table_new (g_direct_hash, g_direct_equal);
+        for (i = 0; i < ario_coverflow_albums_length (old); i++) {
+                album = ario_coverflow_albums_index (old, i);
+                if (ario_coverflow_albums_find_key (new, album->key) < 0)
+                        g_hash_table_insert (removed, (gpointer) album->key, GINT_TO_POINTER (TRUE));
+        }
+        added = g_array_new (FALSE, FALSE, sizeof (ArioCoverflowAlbum));
+        for (i = 0; i < ario_coverflow_albums_length (new); i++) {
+                album = ario_coverflow_albums_index (new, i);
+                old_position = ario_coverflow_albums_find_key (old, album->key);
+                if (old_position < 0 || old_position >= priv->n_indexed)
+                        g_array_append_val (added, *album);
+        }
+        ARIO_LOG_DBG ("Database changed: %u albums added, %u removed",
+                      added->len, g_hash_table_size (removed));
+
+        for (i = MIN (priv->position, ario_coverflow_albums_length (old) - 1);
+             i >= 0 && position < 0; i--) {
+                position = ario_coverflow_albums_find_key (new, ario_coverflow_albums_index (old, i)->key);
+        }
+
+        ario_coverflow_search_remove (priv->search, removed);
+        ario_coverflow_search_add (priv->search,
+                                   (const ArioCoverflowAlbum *) added->data, added->len);
+        g_array_free (added, TRUE);
+        g_hash_table_destroy (removed);
+
+        priv->albums = new;
+        priv->loading = new;
+        priv->n_indexed = ario_coverflow_albums_length (new);
+        priv->position = MAX (position, 0);
+        if (position < 0)
+                priv->offset = 0;
+        ario_coverflow_albums_free (old);
+
+        /* Covers replaced meanwhile are decoded again. The pack
+         * records are keyed on the file time, they go stale alone */
+        changed = g_hash_table_new (g_direct_hash, g_direct_equal);
+        g_hash_table_iter_init (&iter, priv->decoded);
+        while (g_hash_table_iter_next (&iter, &key, NULL)) {
+                position = ario_coverflow_albums_find_key (new, key);
+                if (position >= 0
+                    && cover_changed (coverflow, ario_coverflow_albums_index (new, position))) {
+                        g_hash_table_insert (changed, key, GINT_TO_POINTER (TRUE));
+                        g_hash_table_iter_remove (&iter);
+                        ario_coverflow_cache_remove (priv->cache, key);
+                }
+        }
+        for (i = 0; i < N_COVERS; i++) {
+                if (priv->slot_keys[i] && g_hash_table_lookup (changed, priv->slot_keys[i]))
+                        priv->slot_keys[i] = NULL;
+                if (priv->thumb_keys[i] && g_hash_table_lookup (changed, priv->thumb_keys[i]))
+                        priv->thumb_keys[i] = NULL;
+        }
+        g_hash_table_destroy (changed);
+
+        /* Slots of the albums gone or moved are loaded again, and the
+         * prefetch drops what is no longer around */
+        allocate_textures (coverflow);
+        queue_redraw (coverflow);
+        build_thumbs (coverflow);
+}
+
+static void
+dbtime_changed_cb (ArioServer *server,
+                   ArioCoverflow *coverflow)
+{
+        ArioCoverflowPrivate *priv = coverflow->priv;
+
+        ARIO_LOG_FUNCTION_START;
+
+        /* A reload still running is started over */
+        g_slist_foreach (priv->pending_artists, (GFunc) g_free, NULL);
+        g_slist_free (priv->pending_artists);
+        if (priv->loading != priv->albums)
+                ario_coverflow_albums_free (priv->loading);
+
+        priv->loading = ario_coverflow_albums_new ();
+        priv->pending_artists = ario_server_list_tags (ARIO_TAG_ARTIST, NULL);
+        if (priv->page_source == 0)
+                priv->page_source = g_idle_add_full (G_PRIORITY_LOW,
+                                                     load_albums_idle,
+                                                     coverflow, NULL);
+}
+
+/* The GL widget and the album list, only made when the coverflow is
+ * first shown: until then the source is an empty scrolled window, and
+ * costs nothing to the startup of Ario */
+static void
+init_view (ArioCoverflow *coverflow)
 {
         ARIO_LOG_FUNCTION_START;
-        GtkWidget *scrolledwindow;
         GdkGLConfig *glconfig = NULL;
+        GObject *server;
         int dummy_argc = 1;
         char *dummy_argv[1] = {"coverflow"};
 
-        coverflow->priv = ARIO_COVERFLOW_GET_PRIVATE (coverflow);
-
-        /* Create scrolled window */
-        scrolledwindow = gtk_scrolled_window_new (NULL, NULL);
-        gtk_scrolled_window_set_policy (GTK_SCROLLED_WINDOW (scrolledwindow),
-                                        GTK_POLICY_NEVER, GTK_POLICY_AUTOMATIC);
-
         /* Initialize opengl or display an error */
         ARIO_LOG_DBG("Initializing OpenGL");
         coverflow->priv->connected = ario_server_is_connected ();
         coverflow->priv->gl_initialized = FALSE; /* not initialized by default */
         if (coverflow->priv->connected == FALSE) {
                 coverflow->priv->error_label = gtk_label_new ("Ario not connected");
-                gtk_scrolled_window_add_with_viewport (GTK_SCROLLED_WINDOW (scrolledwindow),
+                gtk_scrolled_window_add_with_viewport (GTK_SCROLLED_WINDOW (coverflow->priv->scrolledwindow),
                                                        coverflow->priv->error_label);
         }
         else if (!gtk_gl_init_check(NULL, NULL))  {
                 coverflow->priv->error_label = gtk_label_new ("Can't initialize OpenGL");
-                gtk_scrolled_window_add_with_viewport (GTK_SCROLLED_WINDOW (scrolledwindow),
+                gtk_scrolled_window_add_with_viewport (GTK_SCROLLED_WINDOW (coverflow->priv->scrolledwindow),
                                                        coverflow->priv->error_label);
         }
         else {
@@ -214,7 +809,7 @@ ario_coverflow_init (ArioCoverflow *coverflow)
                                                               GDK_GL_MODE_DEPTH);
                         if (glconfig == NULL) {
                                 coverflow->priv->error_label = gtk_label_new ("Can't find any OpenGL-capable visual");
-                                gtk_scrolled_window_add_with_viewport (GTK_SCROLLED_WINDOW (scrolledwindow),
+                                gtk_scrolled_window_add_with_viewport (GTK_SCROLLED_WINDOW (coverflow->priv->scrolledwindow),
                                                                        coverflow->priv->error_label);
                         }
                         else {
@@ -232,13 +827,20 @@ ario_coverflow_init (ArioCoverflow *coverflow)
                 glutInit (&dummy_argc, dummy_argv); /* TODO: check if initialized */
                 coverflow->priv->drawing_area = gtk_drawing_area_new();
 
+                /* Before the GL capability, whose own handler
+                 * destroys the context */
+                g_signal_connect (G_OBJECT (coverflow->priv->drawing_area),
+                                  "unrealize", G_CALLBACK (unrealize),
+                                  coverflow);
                 gtk_widget_set_gl_capability (coverflow->priv->drawing_area,
                                               glconfig, NULL, TRUE,
                                               GDK_GL_RGBA_TYPE);
                 gtk_widget_add_events (coverflow->priv->drawing_area,
                                        GDK_BUTTON_PRESS_MASK |
                                        GDK_SCROLL_MASK |
+                                       GDK_KEY_PRESS_MASK |
                                        GDK_VISIBILITY_NOTIFY_MASK);
+                gtk_widget_set_can_focus (coverflow->priv->drawing_area, TRUE);
 
                 g_signal_connect_after (G_OBJECT (coverflow->priv->drawing_area),
                                         "realize", G_CALLBACK (realize), coverflow);
@@ -254,19 +856,52 @@ ario_coverflow_init (ArioCoverflow *coverflow)
                 g_signal_connect (G_OBJECT (coverflow->priv->drawing_area),
                                   "scroll-event", G_CALLBACK (scroll_event),
                                   coverflow);
-                gtk_idle_add (idle, coverflow);
+                g_signal_connect (G_OBJECT (coverflow->priv->drawing_area),
+                                  "key-press-event", G_CALLBACK (key_press_event),
+                                  coverflow);
+                g_signal_connect (G_OBJECT (coverflow->priv->drawing_area),
+                                  "visibility-notify-event", G_CALLBACK (visibility_notify_event),
+                                  coverflow);
+                g_signal_connect (G_OBJECT (coverflow->priv->drawing_area),
+                                  "unmap", G_CALLBACK (unmap),
+                                  coverflow);
 
-                gtk_scrolled_window_add_with_viewport (GTK_SCROLLED_WINDOW (scrolledwindow),
+                gtk_scrolled_window_add_with_viewport (GTK_SCROLLED_WINDOW (coverflow->priv->scrolledwindow),
                                                        coverflow->priv->drawing_area);
 
-                /* Get the album list */
-                coverflow->priv->album = ario_server_get_albums(NULL);
+                init_model (coverflow);
+
+                /* Emitted by the server once its database changed, as
+                 * the browser follows it. Without it, the list is the
+                 * one read at startup */
+                server = G_OBJECT (ario_server_get_instance ());
+                if (g_signal_lookup ("dbtime_changed", G_OBJECT_TYPE (server)))
+                        g_signal_connect_object (server,
+                                                 "dbtime_changed",
+                                                 G_CALLBACK (dbtime_changed_cb),
+                                                 coverflow, 0);
+                else
+                        ARIO_LOG_DBG ("No dbtime_changed signal, database updates are not followed");
         }
 
-        gtk_widget_show_all (scrolledwindow);
+        gtk_widget_show_all (coverflow->priv->scrolledwindow);
+}
+
+static void
+ario_coverflow_init (ArioCoverflow *coverflow)
+{
+        ARIO_LOG_FUNCTION_START;
+
+        coverflow->priv = ARIO_COVERFLOW_GET_PRIVATE (coverflow);
+
+        /* Create scrolled window, filled on the first select */
+        coverflow->priv->scrolledwindow = gtk_scrolled_window_new (NULL, NULL);
+        gtk_scrolled_window_set_policy (GTK_SCROLLED_WINDOW (coverflow->priv->scrolledwindow),
+                                        GTK_POLICY_NEVER, GTK_POLICY_AUTOMATIC);
+        gtk_widget_show (coverflow->priv->scrolledwindow);
 
         /* Add scrolled window to coverflow */
-        gtk_box_pack_start (GTK_BOX (coverflow), scrolledwindow, TRUE, TRUE, 0);
+        gtk_box_pack_start (GTK_BOX (coverflow), coverflow->priv->scrolledwindow, TRUE, TRUE, 0);
 }
 
 static void
@@ -274,6 +909,7 @@ ario_coverflow_finalize (GObject *object)
 {
         ARIO_LOG_FUNCTION_START;
         ArioCoverflow *coverflow;
+        int i;
 
         g_return_if_fail (object != NULL);
         g_return_if_fail (IS_ARIO_COVERFLOW (object));
@@ -282,6 +918,48 @@ ario_coverflow_finalize (GObject *object)
 
         g_return_if_fail (coverflow->priv != NULL);
 
+        stop_animation (coverflow);
+        if (coverflow->priv->scroll_source)
+                g_source_remove (coverflow->priv->scroll_source);
+        if (coverflow->priv->scrub_source)
+                g_source_remove (coverflow->priv->scrub_source);
+        if (coverflow->priv->thumbs_source)
+                g_source_remove (coverflow->priv->thumbs_source);
+        if (coverflow->priv->page_source)
+                g_source_remove (coverflow->priv->page_source);
+        g_slist_foreach (coverflow->priv->pending_artists, (GFunc) g_free, NULL);
+        g_slist_free (coverflow->priv->pending_artists);
+        if (coverflow->priv->loading && coverflow->priv->loading != coverflow->priv->albums)
+                ario_coverflow_albums_free (coverflow->priv->loading);
+        if (coverflow->priv->cover_mtimes)
+                g_hash_table_destroy (coverflow->priv->cover_mtimes);
+        if (coverflow->priv->paths)
+                ario_coverflow_paths_free (coverflow->priv->paths);
+        if (coverflow->priv->loader)
+                ario_coverflow_loader_free (coverflow->priv->loader);
+        if (coverflow->priv->pack)
+                ario_coverflow_pack_close (coverflow->priv->pack);
+        if (coverflow->priv->thumb_loader)
+                ario_coverflow_loader_free (coverflow->priv->thumb_loader);
+        if (coverflow->priv->thumbs)
+                ario_coverflow_pack_close (coverflow->priv->thumbs);
+        for (i = 0; i < N_COVERS; i++) {
+                if (coverflow->priv->thumb_images[i])
+                        ario_coverflow_image_unref (coverflow->priv->thumb_images[i]);
+        }
+        if (coverflow->priv->decoded)
+                g_hash_table_destroy (coverflow->priv->decoded);
+        if (coverflow->priv->cache)
+                ario_coverflow_cache_free (coverflow->priv->cache);
+        if (coverflow->priv->prefetching)
+                g_hash_table_destroy (coverflow->priv->prefetching);
+        if (coverflow->priv->albums)
+                ario_coverflow_albums_free (coverflow->priv->albums);
+        if (coverflow->priv->search)
+                ario_coverflow_search_free (coverflow->priv->search);
+        if (coverflow->priv->typeahead)
+                g_string_free (coverflow->priv->typeahead, TRUE);
+
         G_OBJECT_CLASS (ario_coverflow_parent_class)->finalize (object);
 }
 
@@ -355,24 +1033,31 @@ realize (GtkWidget *widget, gpointer data)
 
         
         glew_code = glewInit();
-        if (glew_code != GLEW_OK) {
+        coverflow->priv->shader_initialized = FALSE;
+        coverflow->priv->instanced = FALSE;
+        coverflow->priv->frame_fbo = 0;
+        if (glew_code != GLEW_OK)
                 ARIO_LOG_DBG ("Can't init GLEW, shaders deactivated");
-                coverflow->priv->shader_initialized = FALSE;
-        }
-      
+        else if (!GLEW_VERSION_3_3)
+                ARIO_LOG_DBG ("OpenGL 3.3 not supported, shaders deactivated");
+
         gl_init_lights ();
+        if (glew_code == GLEW_OK && GLEW_VERSION_3_3
+            && gl_init_shaders (coverflow)) {
+                gl_init_buffers (coverflow);
+                coverflow->priv->instanced = TRUE;
+        } else {
+                /* Fixed pipeline fallback */
+                glNewList (LIST_SQUARE, GL_COMPILE);
+                    draw_square ();
+                glEndList ();
+        }
         gl_init_textures (coverflow);
-#ifdef ARIO_COVERFLOW_USE_SHADERS
-        gl_init_shaders (coverflow);
-#endif
-        allocate_textures (coverflow);
-
-        /* Display lists */
-        glNewList (LIST_SQUARE, GL_COMPILE);
-            draw_square ();
-        glEndList ();
+        gl_init_upload_ring (coverflow);
 
         gdk_gl_drawable_gl_end (gldrawable);
+
+        allocate_textures (coverflow);
 }
 
 static gboolean
@@ -395,19 +1080,36 @@ configure_event (GtkWidget *widget,
         GdkGLContext *glcontext = gtk_widget_get_gl_context (widget);
         GdkGLDrawable *gldrawable = gtk_widget_get_gl_drawable (widget);
         GtkAllocation allocation;
+        GLfloat *m = coverflow->priv->view_projection;
+        gfloat aspect, f;
 
         if (!gdk_gl_drawable_gl_begin (gldrawable, glcontext))
                 return FALSE;
 
         gtk_widget_get_allocation (widget, &allocation);
         glViewport(allocation.x, allocation.y, allocation.width, allocation.height);
+        aspect = ((float) allocation.width)/((float) allocation.height);
 
         glMatrixMode (GL_PROJECTION);
         glLoadIdentity();
-        gluPerspective(60,((float) allocation.width)/((float) allocation.height), 1, 1000);
+        gluPerspective(FOVY, aspect, Z_NEAR, Z_FAR);
+
+        /* Same as gluPerspective then gluLookAt from (0, 0, EYE_DISTANCE),
+         * column major, for the instanced renderer */
+        f = 1 / tan (FOVY * G_PI / 360);
+        memset (m, 0, 16 * sizeof (GLfloat));
+        m[0] = f / aspect;
+        m[5] = f;
+        m[10] = (Z_FAR + Z_NEAR) / (Z_NEAR - Z_FAR);
+        m[11] = -1;
+        m[14] = -EYE_DISTANCE * m[10] + 2 * Z_FAR * Z_NEAR / (Z_NEAR - Z_FAR);
+        m[15] = EYE_DISTANCE;
+
+        gl_resize_frame (coverflow, allocation.width, allocation.height);
 
         gdk_gl_drawable_gl_end (gldrawable);
-        return draw(coverflow);
+        queue_redraw (coverflow);
+        return TRUE;
 }
 
 static gboolean
@@ -417,18 +1119,188 @@ scroll_event (GtkWidget *widget,
 {
         ARIO_LOG_DBG ("Scroll");
         ArioCoverflow *coverflow = (ArioCoverflow *) data;
-
-        if (event->direction == GDK_SCROLL_UP) {
-                if (g_list_next (coverflow->priv->album))
-                        coverflow->priv->album = g_list_next (coverflow->priv->album);
+        ArioCoverflowPrivate *priv = coverflow->priv;
+        gint64 now = g_get_monotonic_time ();
+        gint direction, scrub_speed;
+
+        /* Track where and how fast the user is going, to prefetch ahead */
+        direction = event->direction == GDK_SCROLL_DOWN ? -1 : 1;
+        if (direction != priv->scroll_direction || now - priv->last_scroll > SCROLL_IDLE)
+                priv->scroll_speed = 0;
+        else
+                priv->scroll_speed = (priv->scroll_speed + 1000000.0 / MAX (now - priv->last_scroll, 1)) / 2;
+        priv->scroll_direction = direction;
+        priv->last_scroll = now;
+
+        /* Too fast for the covers to keep up: only thumbnails are shown
+         * until the view settles */
+        scrub_speed = ario_conf_get_integer (PREF_COVERFLOW_SCRUB_SPEED,
+                                             PREF_COVERFLOW_SCRUB_SPEED_DEFAULT);
+        if (!priv->scrubbing && scrub_speed > 0 && priv->scroll_speed > scrub_speed) {
+                ARIO_LOG_DBG ("Scrubbing at %.0f albums/s", priv->scroll_speed);
+                priv->scrubbing = TRUE;
+                priv->scrub_source = g_timeout_add (SCRUB_SETTLE, scrub_settle, coverflow);
         }
-        else if (event->direction == GDK_SCROLL_DOWN) {
-                if (g_list_previous (coverflow->priv->album))
-                        coverflow->priv->album = g_list_previous (coverflow->priv->album);
+
+        if (event->direction == GDK_SCROLL_UP)
+                priv->scroll_pending++;
+        else if (event->direction == GDK_SCROLL_DOWN)
+                priv->scroll_pending--;
+        else
+                return TRUE;
+
+        /* While sliding, the frame timer picks the steps up. Else the
+         * idle runs once the events already queued are handled, and
+         * before the redraw */
+        if (!priv->frame_source && !priv->scroll_source)
+                priv->scroll_source = g_idle_add_full (G_PRIORITY_HIGH_IDLE,
+                                                       scroll_idle,
+                                                       coverflow,
+                                                       NULL);
+
+        return TRUE;
+}
+
+static void
+apply_scroll (ArioCoverflow *coverflow)
+{
+        ArioCoverflowPrivate *priv = coverflow->priv;
+        gint steps = priv->scroll_pending;
+
+        /* Only the final window gets its covers */
+        priv->scroll_pending = 0;
+        if (steps != 0)
+                move_to (coverflow, priv->position + steps);
+}
+
+static gboolean
+scroll_idle (gpointer data)
+{
+        ArioCoverflow *coverflow = (ArioCoverflow *) data;
+
+        coverflow->priv->scroll_source = 0;
+        apply_scroll (coverflow);
+
+        return FALSE;
+}
+
+static gboolean
+scrub_settle (gpointer data)
+{
+        ArioCoverflow *coverflow = (ArioCoverflow *) data;
+        ArioCoverflowPrivate *priv = coverflow->priv;
+
+        if (g_get_monotonic_time () - priv->last_scroll < SCRUB_SETTLE * 1000)
+                return TRUE;
+
+        /* The covers of where the view stopped are requested now */
+        priv->scrubbing = FALSE;
+        priv->scrub_source = 0;
+        allocate_textures (coverflow);
+        queue_redraw (coverflow);
+
+        return FALSE;
+}
+
+static gboolean
+key_press_event (GtkWidget *widget,
+                 GdkEventKey *event,
+                 gpointer data)
+{
+        ArioCoverflow *coverflow = (ArioCoverflow *) data;
+        ArioCoverflowPrivate *priv = coverflow->priv;
+        gint64 now = g_get_monotonic_time ();
+        const gchar *key;
+        gunichar c;
+        gint position;
+
+        switch (event->keyval) {
+        case GDK_Escape:
+                g_string_truncate (priv->typeahead, 0);
+                return TRUE;
+        case GDK_BackSpace:
+                if (priv->typeahead->len == 0)
+                        return FALSE;
+                /* Drop the last character, which may be multibyte */
+                g_string_truncate (priv->typeahead,
+                                   g_utf8_prev_char (priv->typeahead->str + priv->typeahead->len)
+                                   - priv->typeahead->str);
+                priv->last_key = now;
+                return TRUE;
+        case GDK_Left:
+                move_to (coverflow, priv->position - 1);
+                return TRUE;
+        case GDK_Right:
+                move_to (coverflow, priv->position + 1);
+                return TRUE;
+        case GDK_Page_Up:
+                move_to (coverflow, priv->position - N_COVERS);
+                return TRUE;
+        case GDK_Page_Down:
+                move_to (coverflow, priv->position + N_COVERS);
+                return TRUE;
+        case GDK_Home:
+                move_to (coverflow, 0);
+                return TRUE;
+        case GDK_End:
+                move_to (coverflow, ario_coverflow_albums_length (priv->albums) - 1);
+                return TRUE;
+        case GDK_F12:
+                /* Shift writes the stats to a file instead. Both start
+                 * the stats over, to look at one stutter at a time */
+                if (event->state & GDK_SHIFT_MASK) {
+                        dump_stats (coverflow);
+                } else {
+                        priv->show_stats = !priv->show_stats;
+                        if (priv->show_stats)
+                                ario_coverflow_stats_reset ();
+                        queue_redraw (coverflow);
+                }
+                return TRUE;
         }
 
+        c = gdk_keyval_to_unicode (event->keyval);
+        if (c == 0 || !g_unichar_isprint (c)
+            || (event->state & (GDK_CONTROL_MASK | GDK_MOD1_MASK)))
+                return FALSE;
+
+        /* Keys typed in a row make up a single search */
+        if (now - priv->last_key > TYPEAHEAD_TIMEOUT)
+                g_string_truncate (priv->typeahead, 0);
+        priv->last_key = now;
+        g_string_append_unichar (priv->typeahead, c);
+
+        /* The search index resolves the prefix, the first key too, so
+         * case and accents are folded the same way for all of them.
+         * While the list loads, a first key it does not know yet
+         * jumps to the letter */
+        key = ario_coverflow_search_lookup (priv->search, priv->typeahead->str);
+        position = key ? ario_coverflow_albums_find_key (priv->albums, key) : -1;
+        if (position < 0 && g_utf8_strlen (priv->typeahead->str, -1) == 1)
+                position = ario_coverflow_albums_find_letter (priv->albums, c);
+        if (position >= 0)
+                move_to (coverflow, position);
+
+        return TRUE;
+}
+
+static void
+move_to (ArioCoverflow *coverflow, gint position)
+{
+        ArioCoverflowPrivate *priv = coverflow->priv;
+        gint n_albums = ario_coverflow_albums_length (priv->albums);
+
+        position = CLAMP (position, 0, n_albums - 1);
+        if (n_albums == 0 || position == priv->position)
+                return;
+
+        /* Covers slide from where they were, at most by half a window */
+        priv->offset = CLAMP (priv->offset + position - priv->position,
+                              -N_COVERS/2, N_COVERS/2);
+        priv->position = position;
+
         allocate_textures (coverflow);
-        return draw(coverflow);
+        start_animation (coverflow);
 }
 
 static gboolean
@@ -441,16 +1313,19 @@ button_press_event (GtkWidget *widget,
         ArioServerAtomicCriteria atomic_criteria1;
         ArioServerAtomicCriteria atomic_criteria2;
         ArioServerCriteria *criteria = NULL;
-        ArioServerAlbum *album = NULL;
+        ArioCoverflowAlbum *album = NULL;
         GSList *criterias = NULL;
 
-        if (coverflow->priv->album != NULL &&
+        gtk_widget_grab_focus (widget);
+
+        if (ario_coverflow_albums_length (coverflow->priv->albums) > 0 &&
             event->button == 1 && event->type == GDK_2BUTTON_PRESS) {
-                album = (ArioServerAlbum *) coverflow->priv->album->data;
+                album = ario_coverflow_albums_index (coverflow->priv->albums,
+                                                     coverflow->priv->position);
                 atomic_criteria1.tag = ARIO_TAG_ARTIST;
-                atomic_criteria1.value = album->artist;
+                atomic_criteria1.value = (gchar *) album->artist;
                 atomic_criteria2.tag = ARIO_TAG_ALBUM;
-                atomic_criteria2.value = album->album;
+                atomic_criteria2.value = (gchar *) album->album;
 
                 criteria = g_slist_append (criteria, &atomic_criteria1);
                 criteria = g_slist_append (criteria, &atomic_criteria2);
@@ -466,172 +1341,1135 @@ button_press_event (GtkWidget *widget,
                 g_slist_free (criterias);
         }
 
-        return draw(coverflow);
+        return FALSE;
 }
 
 static gboolean
-idle (gpointer data)
+visibility_notify_event (GtkWidget *widget,
+                         GdkEventVisibility *event,
+                         gpointer data)
 {
         ArioCoverflow *coverflow = (ArioCoverflow *) data;
-        ARIO_LOG_DBG ("Idling");
-        return draw (coverflow);
+        gboolean visible = event->state != GDK_VISIBILITY_FULLY_OBSCURED;
+
+        ARIO_LOG_DBG ("Visibility: %d", visible);
+        if (visible == coverflow->priv->visible)
+                return FALSE;
+
+        coverflow->priv->visible = visible;
+        if (visible) {
+                queue_redraw (coverflow);
+                if (coverflow->priv->offset != 0)
+                        start_animation (coverflow);
+        } else {
+                stop_animation (coverflow);
+        }
+
+        return FALSE;
+}
+
+static void
+unmap (GtkWidget *widget, gpointer data)
+{
+        ArioCoverflow *coverflow = (ArioCoverflow *) data;
+
+        /* A visibility notify is received again once remapped */
+        coverflow->priv->visible = FALSE;
+        stop_animation (coverflow);
+}
+
+/* Everything realize made, while its context is still there: also
+ * when the plugin is unloaded, the widget is unrealized before the
+ * object is finalized */
+static void
+unrealize (GtkWidget *widget, gpointer data)
+{
+        ArioCoverflow *coverflow = (ArioCoverflow *) data;
+        ArioCoverflowPrivate *priv = coverflow->priv;
+        GdkGLContext *glcontext = gtk_widget_get_gl_context (widget);
+        GdkGLDrawable *gldrawable = gtk_widget_get_gl_drawable (widget);
+        int i;
+
+        if (!gdk_gl_drawable_gl_begin (gldrawable, glcontext))
+                return;
+
+        gl_free_frame (coverflow);
+        if (priv->covers)
+                gl_free_covers (coverflow);
+        if (priv->thumb_covers)
+                gl_free_thumbs (coverflow);
+
+        for (i = 0; i < UPLOAD_REGIONS; i++) {
+                if (priv->upload_fences[i])
+                        glDeleteSync (priv->upload_fences[i]);
+                priv->upload_fences[i] = NULL;
+        }
+        if (priv->upload_buffer) {
+                glBindBuffer (GL_PIXEL_UNPACK_BUFFER, priv->upload_buffer);
+                glUnmapBuffer (GL_PIXEL_UNPACK_BUFFER);
+                glBindBuffer (GL_PIXEL_UNPACK_BUFFER, 0);
+                glDeleteBuffers (1, &priv->upload_buffer);
+                priv->upload_buffer = 0;
+                priv->upload_map = NULL;
+                priv->upload_next = 0;
+        }
+        ario_coverflow_stats_set (ARIO_COVERFLOW_STATS_BUFFER_BYTES, 0);
+
+        if (priv->instanced) {
+                glDeleteVertexArrays (1, &priv->vertex_array);
+                glDeleteBuffers (1, &priv->quad_buffer);
+                glDeleteBuffers (1, &priv->instance_buffer);
+                priv->vertex_array = 0;
+                priv->quad_buffer = 0;
+                priv->instance_buffer = 0;
+                priv->instanced = FALSE;
+        } else {
+                glDeleteLists (LIST_SQUARE, 1);
+        }
+        if (priv->program != INVALID_PROGRAM) {
+                glDeleteProgram (priv->program);
+                priv->program = INVALID_PROGRAM;
+        }
+        if (priv->vshader != INVALID_SHADER)
+                glDeleteShader (priv->vshader);
+        if (priv->fshader != INVALID_SHADER)
+                glDeleteShader (priv->fshader);
+        priv->vshader = priv->fshader = INVALID_SHADER;
+        priv->shader_initialized = FALSE;
+
+        gdk_gl_drawable_gl_end (gldrawable);
+}
+
+static void
+queue_redraw (ArioCoverflow *coverflow)
+{
+        coverflow->priv->frame_valid = FALSE;
+
+        /* Exposes are coalesced by GTK into a single draw */
+        if (coverflow->priv->visible)
+                gtk_widget_queue_draw (coverflow->priv->drawing_area);
+}
+
+static void
+start_animation (ArioCoverflow *coverflow)
+{
+        ArioCoverflowPrivate *priv = coverflow->priv;
+
+        queue_redraw (coverflow);
+        if (priv->frame_source || !priv->visible || priv->offset == 0)
+                return;
+
+        priv->last_frame = g_get_monotonic_time ();
+        priv->frame_source = g_timeout_add (FRAME_INTERVAL, frame_tick, coverflow);
+}
+
+static void
+stop_animation (ArioCoverflow *coverflow)
+{
+        ArioCoverflowPrivate *priv = coverflow->priv;
+
+        if (priv->frame_source) {
+                g_source_remove (priv->frame_source);
+                priv->frame_source = 0;
+        }
+
+        /* Steps the frame timer was to pick up */
+        if (priv->scroll_pending && !priv->scroll_source)
+                priv->scroll_source = g_idle_add_full (G_PRIORITY_HIGH_IDLE,
+                                                       scroll_idle,
+                                                       coverflow,
+                                                       NULL);
+}
+
+static gboolean
+frame_tick (gpointer data)
+{
+        ArioCoverflow *coverflow = (ArioCoverflow *) data;
+        ArioCoverflowPrivate *priv = coverflow->priv;
+        gint64 now = g_get_monotonic_time ();
+        gfloat step;
+
+        apply_scroll (coverflow);
+
+        /* Slide towards the current position, paced by elapsed time so
+         * late timeouts do not slow the animation down */
+        step = (gfloat) (now - priv->last_frame) / SCROLL_DURATION;
+        priv->last_frame = now;
+        if (priv->offset > 0)
+                priv->offset = MAX (priv->offset - step, 0);
+        else
+                priv->offset = MIN (priv->offset + step, 0);
+
+        queue_redraw (coverflow);
+        if (priv->offset == 0) {
+                priv->frame_source = 0;
+                return FALSE;
+        }
+        return TRUE;
 }
 
 static gboolean
 draw (ArioCoverflow *coverflow)
 {
         ARIO_LOG_DBG ("Drawing");
+        ArioCoverflowPrivate *priv = coverflow->priv;
         GdkGLContext *glcontext = gtk_widget_get_gl_context (coverflow->priv->drawing_area);
         GdkGLDrawable *gldrawable = gtk_widget_get_gl_drawable (coverflow->priv->drawing_area);
+        gint64 start = ario_coverflow_stats_now ();
+        gint64 t;
 
         if (!gdk_gl_drawable_gl_begin (gldrawable, glcontext))
                 return FALSE;
 
-        /* Clear */
-        glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-        /* Draw */
-        glMatrixMode (GL_MODELVIEW);
-        glLoadIdentity();
-        gluLookAt(0,0,2,0,0,0,0,1,0);
-
-        draw_albums(coverflow);
+        if (priv->upload_deferred && upload_pending (coverflow))
+                priv->frame_valid = FALSE;
+        t = ario_coverflow_stats_now ();
+
+        /* The scene is only drawn again when it changed */
+        if (priv->frame_fbo && priv->frame_valid) {
+                ario_coverflow_stats_count (ARIO_COVERFLOW_STATS_FRAME_REUSES, 1);
+        } else {
+                if (priv->frame_fbo)
+                        glBindFramebuffer (GL_FRAMEBUFFER, priv->frame_fbo);
+
+                /* Clear */
+                glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+                /* Draw */
+                if (priv->instanced) {
+                        draw_albums_instanced (coverflow);
+                } else {
+                        glMatrixMode (GL_MODELVIEW);
+                        glLoadIdentity();
+                        gluLookAt(0,0,EYE_DISTANCE,0,0,0,0,1,0);
+
+                        draw_albums(coverflow);
+                }
+                priv->frame_valid = priv->frame_fbo != 0;
+        }
+        if (priv->frame_fbo) {
+                glBindFramebuffer (GL_READ_FRAMEBUFFER, priv->frame_fbo);
+                glBindFramebuffer (GL_DRAW_FRAMEBUFFER, 0);
+                glBlitFramebuffer (0, 0, priv->frame_width, priv->frame_height,
+                                   0, 0, priv->frame_width, priv->frame_height,
+                                   GL_COLOR_BUFFER_BIT, GL_NEAREST);
+                glBindFramebuffer (GL_FRAMEBUFFER, 0);
+        }
+        if (priv->show_stats)
+                draw_stats (coverflow);
+        t = ario_coverflow_stats_time (ARIO_COVERFLOW_STATS_DRAW, t);
 
         /* Swap buffers */
         if (gdk_gl_drawable_is_double_buffered (gldrawable))
                 gdk_gl_drawable_swap_buffers (gldrawable);
         else
                 glFlush ();
+        ario_coverflow_stats_time (ARIO_COVERFLOW_STATS_SWAP, t);
 
         gdk_gl_drawable_gl_end (gldrawable);
+        ario_coverflow_stats_time (ARIO_COVERFLOW_STATS_FRAME, start);
+
+        /* Try the covers left over again at the next frame */
+        if (priv->upload_deferred)
+                queue_redraw (coverflow);
         return TRUE;
 }
 
+/* The cover quad as a triangle strip: x, y, s, t. The top of the
+ * image is at t = 0 */
+static const GLfloat quad[4][4] = {
+        { -0.6, -0.6, 0, 1 },
+        {  0.6, -0.6, 1, 1 },
+        { -0.6,  0.6, 0, 0 },
+        {  0.6,  0.6, 1, 0 },
+};
+
 static void
 draw_square (void)
 {
         int i;
-        static GLfloat vertices[4][2] = {
-            { -0.6, -0.6 },
-            { -0.6,  0.6 },
-            {  0.6,  0.6 },
-            {  0.6, -0.6 },
-        };
-        static GLfloat texture[4][2] = {
-          { 0, 0 },
-          { 1, 0 },
-          { 1, 1 },
-          { 0, 1 },
-        };
         static GLfloat normal[3] = { 0.0, 0.0, 1.0 };
 
-        glBegin (GL_QUADS);
+        glBegin (GL_TRIANGLE_STRIP);
         glNormal3fv (normal);
         for (i = 0; i < 4; i++) {
-          glVertex2fv (vertices[i]);
-          glTexCoord2fv (texture[i]);
+          glTexCoord2fv (quad[i] + 2);
+          glVertex2fv (quad[i]);
         }
         glEnd ();
 }
 
-static void
-draw_albums (ArioCoverflow *coverflow)
+/* Whether a slot is drawn from the covers texture, else it is from
+ * the thumbnails one */
+static gboolean
+slot_shows_cover (ArioCoverflow *coverflow, int slot)
 {
-        int i, texture_left, texture_right;
-        GList *left, *right;
-
-        glBindTexture (GL_TEXTURE_2D, coverflow->priv->textures[N_COVERS/2]);
-        glPushMatrix ();
-        glScalef (SCALE_FACTOR, SCALE_FACTOR, SCALE_FACTOR);
-        glTranslatef (0, 0, SHIFT_GREAT_COVER);
-        glCallList (LIST_SQUARE);
-        glPopMatrix ();
+        return !coverflow->priv->scrubbing && coverflow->priv->slot_loaded[slot];
+}
 
-        texture_left = N_COVERS/2-1;
-        texture_right = N_COVERS/2+1;
-        right = left = coverflow->priv->album;
-        for (i = 0; i < N_COVERS/2; i++) {
-                if (g_list_previous (left)) {
-                        left = g_list_previous (left);
-                        glPushMatrix();
-                          glBindTexture (GL_TEXTURE_2D, coverflow->priv->textures[texture_left]);
-                          glTranslatef (-SHIFT_BETWEEN_COVERS*i-SHIFT_COVERS, 0, 0);
-                          glRotatef (ANGLE, 0, 1, 0);
-                          glCallList (LIST_SQUARE);
-                        glPopMatrix ();
-                        texture_left--;
-                }
+/* Layer the slot is drawn from: its cover, else its thumbnail (while
+ * scrubbing, or when it is of the album the slot waits for), else the
+ * placeholder */
+static int
+slot_layer (ArioCoverflow *coverflow, int slot)
+{
+        ArioCoverflowPrivate *priv = coverflow->priv;
+
+        if (slot_shows_cover (coverflow, slot))
+                return slot;
+        if (priv->thumb_loaded[slot] && priv->thumb_keys[slot]
+            && (priv->scrubbing || priv->thumb_keys[slot] == priv->slot_keys[slot]))
+                return slot;
+        return PLACEHOLDER_LAYER;
+}
 
-                if (g_list_next (right)) {
-                        right = g_list_next (right);
-                        glPushMatrix();
-                          glBindTexture (GL_TEXTURE_2D, coverflow->priv->textures[texture_right]);
-                          glTranslatef (SHIFT_BETWEEN_COVERS*i+SHIFT_COVERS, 0, 0);
-                          glRotatef (-ANGLE, 0, 1, 0);
-                          glCallList (LIST_SQUARE);
-                        glPopMatrix ();
-                        texture_right++;
-                }
-        }
+/* Side covers are small and far, they read coarser mip levels than
+ * the center one */
+static gfloat
+cover_lod_bias (gfloat x)
+{
+        return SIDE_LOD_BIAS * MIN (ABS (x), 1);
 }
 
+/* Maps the quad onto an atlas cell with the texture matrix */
 static void
-allocate_textures (ArioCoverflow *coverflow)
+select_cell (int layer)
 {
-        int i, texture_left, texture_right;
-        GList *left, *right;
-
-        /* Current cover */
-        glBindTexture (GL_TEXTURE_2D, coverflow->priv->textures[N_COVERS/2]);
-        load_texture(coverflow->priv->album->data);
-
-        texture_left = N_COVERS/2-1;
-        texture_right = N_COVERS/2+1;
-        right = left = coverflow->priv->album;
-        for (i = 0; i < N_COVERS/2; i++) {
-                if (g_list_previous (left)) {
-                        left = g_list_previous (left);
-                        glBindTexture (GL_TEXTURE_2D, coverflow->priv->textures[texture_left]);
-                        load_texture (left->data);
-                        texture_left--;
-                }
-                if (g_list_next (right)) {
-                        right = g_list_next (right);
-                        glBindTexture (GL_TEXTURE_2D, coverflow->priv->textures[texture_right]);
-                        load_texture (right->data);
-                        texture_right++;
-                }
+        glMatrixMode (GL_TEXTURE);
+        glLoadIdentity ();
+        glTranslatef ((gfloat) (layer % ATLAS_COLUMNS) / ATLAS_COLUMNS,
+                      (gfloat) (layer / ATLAS_COLUMNS) / ATLAS_ROWS, 0);
+        glScalef (1.0 / ATLAS_COLUMNS, 1.0 / ATLAS_ROWS, 1);
+        glMatrixMode (GL_MODELVIEW);
+}
+
+/* Model matrix, column major, of the cover at x from the center */
+static void
+cover_transform (gfloat x, GLfloat *m)
+{
+        gfloat t = MIN (ABS (x), 1);
+        gfloat side = x < 0 ? -1 : 1;
+        gfloat angle = -side*ANGLE*t*G_PI/180;
+        gfloat scale = SCALE_FACTOR+(1-SCALE_FACTOR)*t;
+        gfloat c = cos (angle) * scale;
+        gfloat s = sin (angle) * scale;
+
+        memset (m, 0, 16 * sizeof (GLfloat));
+
+        /* Between the center and the first side position the cover is
+         * interpolated, further away covers are evenly spaced */
+        if (ABS (x) <= 1) {
+                m[12] = side*t*SHIFT_COVERS;
+                m[14] = SCALE_FACTOR*SHIFT_GREAT_COVER*(1-t);
+        } else {
+                m[12] = side*(SHIFT_BETWEEN_COVERS*(ABS (x)-1)+SHIFT_COVERS);
         }
+        m[15] = 1;
+
+        /* Rotation around y, then scale */
+        m[0] = c;
+        m[2] = -s;
+        m[5] = scale;
+        m[8] = s;
+        m[10] = c;
 }
 
+/* Calls func on each visible cover, center first */
 static void
-load_texture (ArioServerAlbum *album)
+foreach_cover (ArioCoverflow *coverflow,
+               void (*func) (ArioCoverflow *coverflow, int slot, gfloat x, gpointer data),
+               gpointer data)
 {
-  GLsizei width, height;
-  guchar *pixels;
-  gchar *cover_path;
-  GdkPixbuf *pixbuf;
+        ArioCoverflowPrivate *priv = coverflow->priv;
+        gint n_albums = ario_coverflow_albums_length (priv->albums);
+        int i;
 
-  ARIO_LOG_DBG ("Loading texture for: %s - %s", album->artist, album->album);
-        cover_path = ario_cover_make_cover_path (album->artist, album->album, NORMAL_COVER);
-        pixbuf = gdk_pixbuf_new_from_file (cover_path, NULL);
-        if (pixbuf != NULL) {
-                pixels = gdk_pixbuf_get_pixels (pixbuf);
-                width = gdk_pixbuf_get_width (pixbuf);
-                height = gdk_pixbuf_get_height (pixbuf);
+        if (n_albums == 0)
+                return;
+
+        func (coverflow, SLOT (priv->position), priv->offset, data);
 
-                glTexImage2D (GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB,
-                              GL_UNSIGNED_BYTE, (GLvoid *) pixels);
-                g_free (pixels);
-                /*g_object_unref (pixbuf);*/
+        for (i = 1; i <= N_COVERS/2; i++) {
+                if (priv->position - i >= 0)
+                        func (coverflow, SLOT (priv->position - i),
+                              priv->offset - i, data);
+                if (priv->position + i < n_albums)
+                        func (coverflow, SLOT (priv->position + i),
+                              priv->offset + i, data);
         }
-        else {
+}
+
+/* data tells which of the covers or the thumbnails are drawn */
+static void
+draw_cover (ArioCoverflow *coverflow, int slot, gfloat x, gpointer data)
+{
+        GLfloat model[16];
+
+        if (slot_shows_cover (coverflow, slot) != GPOINTER_TO_INT (data))
+                return;
+
+        cover_transform (x, model);
+        glPushMatrix ();
+          select_cell (slot_layer (coverflow, slot));
+          if (GLEW_VERSION_1_4)
+                  glTexEnvf (GL_TEXTURE_FILTER_CONTROL, GL_TEXTURE_LOD_BIAS,
+                             cover_lod_bias (x));
+          glMultMatrixf (model);
+          glCallList (LIST_SQUARE);
+        glPopMatrix ();
+}
+
+static void
+draw_albums (ArioCoverflow *coverflow)
+{
+        glBindTexture (GL_TEXTURE_2D, coverflow->priv->covers);
+        foreach_cover (coverflow, draw_cover, GINT_TO_POINTER (TRUE));
+        glBindTexture (GL_TEXTURE_2D, coverflow->priv->thumb_covers);
+        foreach_cover (coverflow, draw_cover, GINT_TO_POINTER (FALSE));
+
+        glMatrixMode (GL_TEXTURE);
+        glLoadIdentity ();
+        glMatrixMode (GL_MODELVIEW);
+        if (GLEW_VERSION_1_4)
+                glTexEnvf (GL_TEXTURE_FILTER_CONTROL, GL_TEXTURE_LOD_BIAS, 0);
+}
+
+static void
+add_instance (ArioCoverflow *coverflow, int slot, gfloat x, gpointer data)
+{
+        CoverInstances *instances = data;
+        CoverInstance *instance;
+
+        if (slot_shows_cover (coverflow, slot) != instances->covers_pass)
+                return;
+
+        instance = &instances->covers[instances->n_covers++];
+        cover_transform (x, instance->model);
+        instance->layer = slot_layer (coverflow, slot);
+        instance->lod_bias = cover_lod_bias (x);
+}
+
+/* The covers, then the thumbnails, each in one call */
+static void
+draw_albums_instanced (ArioCoverflow *coverflow)
+{
+        draw_instances (coverflow, TRUE);
+        draw_instances (coverflow, FALSE);
+}
+
+static void
+draw_instances (ArioCoverflow *coverflow,
+                gboolean covers_pass)
+{
+        ArioCoverflowPrivate *priv = coverflow->priv;
+        CoverInstances instances;
+
+        instances.n_covers = 0;
+        instances.covers_pass = covers_pass;
+        foreach_cover (coverflow, add_instance, &instances);
+        if (instances.n_covers == 0)
+                return;
+
+        glBindTexture (GL_TEXTURE_2D_ARRAY, covers_pass ? priv->covers : priv->thumb_covers);
+        glUseProgram (priv->program);
+        glUniformMatrix4fv (priv->view_projection_location, 1, GL_FALSE,
+                            priv->view_projection);
+
+        /* Orphan the previous frame's storage rather than wait for it */
+        glBindBuffer (GL_ARRAY_BUFFER, priv->instance_buffer);
+        glBufferData (GL_ARRAY_BUFFER, sizeof (instances.covers), NULL, GL_STREAM_DRAW);
+        glBufferSubData (GL_ARRAY_BUFFER, 0,
+                         instances.n_covers * sizeof (CoverInstance), instances.covers);
+        glBindBuffer (GL_ARRAY_BUFFER, 0);
+
+        glBindVertexArray (priv->vertex_array);
+        glDrawArraysInstanced (GL_TRIANGLE_STRIP, 0, 4, instances.n_covers);
+        glBindVertexArray (0);
+        glUseProgram (0);
+}
+
+/* Text in the top left corner, in the fixed pipeline, over whatever
+ * renderer drew the covers */
+static void
+draw_stats (ArioCoverflow *coverflow)
+{
+        GtkAllocation allocation;
+        gchar *summary, **lines;
+        const gchar *c;
+        int i;
+
+        gtk_widget_get_allocation (coverflow->priv->drawing_area, &allocation);
+        summary = ario_coverflow_stats_summary ();
+        lines = g_strsplit (summary, "\n", -1);
+        g_free (summary);
+
+        glPushAttrib (GL_ENABLE_BIT | GL_CURRENT_BIT);
+        glDisable (GL_DEPTH_TEST);
+        glDisable (GL_TEXTURE_2D);
+        glMatrixMode (GL_PROJECTION);
+        glPushMatrix ();
+        glLoadIdentity ();
+        gluOrtho2D (0, allocation.width, 0, allocation.height);
+        glMatrixMode (GL_MODELVIEW);
+        glPushMatrix ();
+        glLoadIdentity ();
+
+        glColor3f (1.0, 1.0, 0.6);
+        for (i = 0; lines[i]; i++) {
+                glRasterPos2i (STATS_LINE_HEIGHT / 2,
+                               allocation.height - (i + 1) * STATS_LINE_HEIGHT);
+                for (c = lines[i]; *c; c++)
+                        glutBitmapCharacter (GLUT_BITMAP_9_BY_15, *c);
+        }
+
+        glPopMatrix ();
+        glMatrixMode (GL_PROJECTION);
+        glPopMatrix ();
+        glMatrixMode (GL_MODELVIEW);
+        glPopAttrib ();
+        g_strfreev (lines);
+}
+
+static void
+dump_stats (ArioCoverflow *coverflow)
+{
+        gchar *filename;
+        GError *error = NULL;
+
+        filename = g_build_filename (ario_util_config_dir (), "coverflow-stats.txt", NULL);
+        if (ario_coverflow_stats_dump (filename, &error)) {
+                ario_coverflow_stats_reset ();
+        } else {
+                ARIO_LOG_DBG ("Can't write %s: %s", filename, error->message);
+                g_error_free (error);
+        }
+        g_free (filename);
+}
+
+static void
+allocate_textures (ArioCoverflow *coverflow)
+{
+        ArioCoverflowPrivate *priv = coverflow->priv;
+        ArioCoverflowAlbum *album;
+        gint n_albums = ario_coverflow_albums_length (priv->albums);
+        int i;
+
+        if (n_albums == 0)
+                return;
+
+        /* Slots already holding their album are left untouched. While
+         * scrubbing, no cover is requested */
+        for (i = MAX (priv->position - N_COVERS/2, 0);
+             i <= MIN (priv->position + N_COVERS/2, n_albums - 1); i++) {
+                album = ario_coverflow_albums_index (priv->albums, i);
+                load_thumb (coverflow, SLOT (i), album);
+                if (!priv->scrubbing)
+                        load_texture (coverflow, SLOT (i), album);
+        }
+
+        upload_slots (coverflow);
+        if (!priv->scrubbing)
+                prefetch (coverflow);
+}
+
+/* The thumbnail of an album from the pack, a new reference, or NULL.
+ * A missing one is decoded if priority is not negative */
+static ArioCoverflowImage *
+lookup_thumb (ArioCoverflow *coverflow,
+              ArioCoverflowAlbum *album,
+              gint priority)
+{
+        ArioCoverflowPrivate *priv = coverflow->priv;
+        ArioCoverflowImage *image = NULL;
+        const gchar *cover_path;
+        gint64 mtime;
+        goffset size;
+
+        cover_path = ario_coverflow_paths_lookup (priv->paths, album->key,
+                                                  album->artist, album->album, &mtime, &size);
+        if (cover_path && size > 0) {
+                if (priv->thumbs)
+                        image = ario_coverflow_pack_lookup (priv->thumbs, album->key,
+                                                            mtime, THUMB_SIZE);
+                if (image == NULL && priority >= 0
+                    && !ario_coverflow_loader_is_pending (priv->thumb_loader, album->key)) {
+                        ario_coverflow_loader_request (priv->thumb_loader, album->key,
+                                                       cover_path, mtime, priority);
+                        priv->thumbs_in_flight++;
+                }
+        }
+
+        return image;
+}
+
+static void
+load_thumb (ArioCoverflow *coverflow,
+            int slot,
+            ArioCoverflowAlbum *album)
+{
+        ArioCoverflowPrivate *priv = coverflow->priv;
+
+        if (priv->thumb_keys[slot] == album->key)
+                return;
+
+        priv->thumb_keys[slot] = album->key;
+        priv->thumb_loaded[slot] = FALSE;
+        if (priv->thumb_images[slot])
+                ario_coverflow_image_unref (priv->thumb_images[slot]);
+
+        /* Only decoded when scrubbing, else the cover itself is */
+        priv->thumb_images[slot] = lookup_thumb (coverflow, album,
+                                                 priv->scrubbing ? 0 : -1);
+}
+
+static void
+thumb_loaded (const gchar *key,
+              gint64 mtime,
+              ArioCoverflowImage *image,
+              gpointer data)
+{
+        ArioCoverflow *coverflow = (ArioCoverflow *) data;
+        ArioCoverflowPrivate *priv = coverflow->priv;
+        gboolean wanted = FALSE;
+        int i;
+
+        priv->thumbs_in_flight--;
+        for (i = 0; i < N_COVERS && image; i++) {
+                if (priv->thumb_keys[i] == key && !priv->thumb_loaded[i]
+                    && priv->thumb_images[i] == NULL) {
+                        priv->thumb_images[i] = ario_coverflow_image_ref (image);
+                        wanted = TRUE;
+                }
+        }
+        if (wanted)
+                upload_slots (coverflow);
+
+        /* The builder waits for a free place */
+        if (priv->thumbs_next >= 0 && priv->thumbs_source == 0
+            && priv->thumbs_next < ario_coverflow_albums_length (priv->albums))
+                priv->thumbs_source = g_idle_add_full (G_PRIORITY_LOW,
+                                                       build_thumbs_idle,
+                                                       coverflow,
+                                                       NULL);
+}
+
+static gboolean
+build_thumbs_idle (gpointer data)
+{
+        ArioCoverflow *coverflow = (ArioCoverflow *) data;
+        ArioCoverflowPrivate *priv = coverflow->priv;
+        ArioCoverflowImage *image;
+        gint n_albums = ario_coverflow_albums_length (priv->albums);
+        gint64 deadline = g_get_monotonic_time () + PAGE_BUDGET;
+
+        /* A full pack is not evicted from, the albums past it just
+         * have no thumbnail, else the builder would go round the list
+         * for ever */
+        if (ario_coverflow_pack_is_full (priv->thumbs)) {
+                ARIO_LOG_DBG ("Thumbnails full at %d of %d", priv->thumbs_next, n_albums);
+                priv->thumbs_next = n_albums;
+        }
+
+        while (priv->thumbs_next < n_albums && priv->thumbs_in_flight < THUMB_BATCH
+               && g_get_monotonic_time () < deadline) {
+                image = lookup_thumb (coverflow,
+                                      ario_coverflow_albums_index (priv->albums, priv->thumbs_next++),
+                                      THUMB_BUILD_PRIORITY);
+                if (image)
+                        ario_coverflow_image_unref (image);
+        }
+        if (priv->thumbs_next < n_albums && priv->thumbs_in_flight < THUMB_BATCH)
+                return TRUE;
+
+        /* Started again by thumb_loaded */
+        ARIO_LOG_DBG ("Thumbnails checked up to %d of %d", priv->thumbs_next, n_albums);
+        priv->thumbs_source = 0;
+        return FALSE;
+}
+
+/* Makes sure every album of the list has its thumbnail, a few at a
+ * time, in the idle */
+static void
+build_thumbs (ArioCoverflow *coverflow)
+{
+        ArioCoverflowPrivate *priv = coverflow->priv;
+
+        if (priv->thumbs == NULL || ario_coverflow_pack_is_full (priv->thumbs))
+                return;
+
+        priv->thumbs_next = 0;
+        if (priv->thumbs_source == 0)
+                priv->thumbs_source = g_idle_add_full (G_PRIORITY_LOW,
+                                                       build_thumbs_idle,
+                                                       coverflow,
+                                                       NULL);
+}
+
+static void
+prefetch_album (ArioCoverflow *coverflow,
+                GHashTable *wanted,
+                gint position,
+                gint distance)
+{
+        ArioCoverflowPrivate *priv = coverflow->priv;
+        ArioCoverflowAlbum *album;
+
+        if (position < 0 || position >= ario_coverflow_albums_length (priv->albums))
+                return;
+
+        album = ario_coverflow_albums_index (priv->albums, position);
+        g_hash_table_insert (wanted, (gpointer) album->key, GINT_TO_POINTER (TRUE));
+        if (distance <= N_COVERS/2
+            || g_hash_table_lookup_extended (priv->decoded, album->key, NULL, NULL))
+                return;
+
+        /* Visible covers are requested with priority 0, so prefetched
+         * ones come after them, nearest first */
+        request_cover (coverflow, album, album->key, distance);
+}
+
+static void
+prefetch (ArioCoverflow *coverflow)
+{
+        ArioCoverflowPrivate *priv = coverflow->priv;
+        GHashTable *wanted;
+        GHashTableIter iter;
+        gpointer key, image;
+        int i, depth, n_ahead, n_behind;
+
+        /* The faster the scroll, the further ahead we decode, up to the
+         * configured depth. Behind us, only a few covers are kept */
+        depth = MAX (ario_conf_get_integer (PREF_COVERFLOW_PREFETCH_DEPTH,
+                                            PREF_COVERFLOW_PREFETCH_DEPTH_DEFAULT),
+                     N_COVERS/2);
+        n_ahead = CLAMP (N_COVERS/2 + 1 + (int) (priv->scroll_speed * PREFETCH_LOOKAHEAD),
+                         N_COVERS/2, depth);
+        n_behind = N_COVERS/2 + PREFETCH_BEHIND;
+
+        wanted = g_hash_table_new (g_direct_hash, g_direct_equal);
+        prefetch_album (coverflow, wanted, priv->position, 0);
+        for (i = 1; i <= MAX (n_ahead, n_behind); i++) {
+                if (i <= n_ahead)
+                        prefetch_album (coverflow, wanted,
+                                        priv->position + i * priv->scroll_direction, i);
+                if (i <= n_behind)
+                        prefetch_album (coverflow, wanted,
+                                        priv->position - i * priv->scroll_direction, i);
+        }
+
+        /* Requests and covers we moved away from (e.g. when the user
+         * reversed direction) are dropped */
+        g_hash_table_iter_init (&iter, priv->prefetching);
+        while (g_hash_table_iter_next (&iter, &key, NULL)) {
+                if (!g_hash_table_lookup (wanted, key))
+                        ario_coverflow_loader_cancel (priv->loader, key);
+        }
+        g_hash_table_iter_init (&iter, priv->decoded);
+        while (g_hash_table_iter_next (&iter, &key, &image)) {
+                if (!g_hash_table_lookup (wanted, key)) {
+                        /* Covers mapped from the pack are in memory
+                         * anyway */
+                        if (image && !ario_coverflow_image_is_mapped (image))
+                                ario_coverflow_cache_insert (priv->cache, key,
+                                                             get_cover_mtime (coverflow, key),
+                                                             image);
+                        g_hash_table_remove (priv->cover_mtimes, key);
+                        g_hash_table_iter_remove (&iter);
+                }
+        }
+
+        g_hash_table_destroy (priv->prefetching);
+        priv->prefetching = wanted;
+}
+
+static void
+unref_image (gpointer image)
+{
+        if (image)
+                ario_coverflow_image_unref (image);
+}
+
+/* A cover file was added, rewritten or removed: whatever was made from
+ * the old one is dropped, and the slots showing it load it again. The
+ * pack records are keyed on the file time, they go stale alone */
+static void
+cover_file_changed (const gchar *key,
+                    gpointer data)
+{
+        ArioCoverflow *coverflow = (ArioCoverflow *) data;
+        ArioCoverflowPrivate *priv = coverflow->priv;
+        gboolean shown = FALSE;
+        int i;
+
+        ARIO_LOG_DBG ("Cover changed: %s", key);
+        g_hash_table_remove (priv->decoded, key);
+        g_hash_table_remove (priv->cover_mtimes, key);
+        ario_coverflow_cache_remove (priv->cache, key);
+
+        for (i = 0; i < N_COVERS; i++) {
+                if (priv->slot_keys[i] == key) {
+                        priv->slot_keys[i] = NULL;
+                        priv->slot_loaded[i] = FALSE;
+                        shown = TRUE;
+                }
+                if (priv->thumb_keys[i] == key) {
+                        priv->thumb_keys[i] = NULL;
+                        priv->thumb_loaded[i] = FALSE;
+                        if (priv->thumb_images[i]) {
+                                ario_coverflow_image_unref (priv->thumb_images[i]);
+                                priv->thumb_images[i] = NULL;
+                        }
+                        shown = TRUE;
+                }
+        }
+
+        if (shown) {
+                allocate_textures (coverflow);
+                queue_redraw (coverflow);
+        }
+}
+
+/* While the coverflow is not shown: no timer runs, nothing is decoded
+ * ahead, and of the textures and the decoded covers only the retained
+ * budget is kept, textures first. The frame cache always goes, it is
+ * redrawn anyway */
+static void
+release_resources (ArioCoverflow *coverflow)
+{
+        ArioCoverflowPrivate *priv = coverflow->priv;
+        GdkGLContext *glcontext;
+        GdkGLDrawable *gldrawable;
+        GHashTableIter iter;
+        gpointer key, image;
+        gsize retained, cover_bytes, thumb_bytes;
+        int i;
+
+        retained = (gsize) MAX (ario_conf_get_integer (PREF_COVERFLOW_RETAINED_SIZE,
+                                                       PREF_COVERFLOW_RETAINED_SIZE_DEFAULT), 0) << 20;
+
+        stop_animation (coverflow);
+        if (priv->scroll_source) {
+                g_source_remove (priv->scroll_source);
+                priv->scroll_source = 0;
+        }
+        priv->scroll_pending = 0;
+        priv->offset = 0;
+        if (priv->scrub_source) {
+                g_source_remove (priv->scrub_source);
+                priv->scrub_source = 0;
+        }
+        priv->scrubbing = FALSE;
+        if (priv->thumbs_source) {
+                g_source_remove (priv->thumbs_source);
+                priv->thumbs_source = 0;
+        }
+
+        g_hash_table_iter_init (&iter, priv->prefetching);
+        while (g_hash_table_iter_next (&iter, &key, NULL))
+                ario_coverflow_loader_cancel (priv->loader, key);
+        g_hash_table_remove_all (priv->prefetching);
+
+        /* Decoded covers go through the cache, like the ones prefetch
+         * drops, and compete there for what is left of the budget */
+        g_hash_table_iter_init (&iter, priv->decoded);
+        while (g_hash_table_iter_next (&iter, &key, &image)) {
+                if (image && !ario_coverflow_image_is_mapped (image))
+                        ario_coverflow_cache_insert (priv->cache, key,
+                                                     get_cover_mtime (coverflow, key),
+                                                     image);
+        }
+        g_hash_table_remove_all (priv->decoded);
+        g_hash_table_remove_all (priv->cover_mtimes);
+
+        /* Slots still waiting for their cover request it again */
+        for (i = 0; i < N_COVERS; i++) {
+                if (!priv->slot_loaded[i])
+                        priv->slot_keys[i] = NULL;
+                if (!priv->thumb_loaded[i]) {
+                        priv->thumb_keys[i] = NULL;
+                        if (priv->thumb_images[i]) {
+                                ario_coverflow_image_unref (priv->thumb_images[i]);
+                                priv->thumb_images[i] = NULL;
+                        }
+                }
+        }
+
+        /* Each texture is kept if it fits in what is left, the
+         * thumbnails first as they are the smallest, and the decoded
+         * covers get the rest */
+        thumb_bytes = gl_layers_length (THUMB_SIZE);
+        cover_bytes = gl_layers_length (priv->cover_size);
+        if (gtk_widget_get_realized (priv->drawing_area)) {
+                glcontext = gtk_widget_get_gl_context (priv->drawing_area);
+                gldrawable = gtk_widget_get_gl_drawable (priv->drawing_area);
+                if (gdk_gl_drawable_gl_begin (gldrawable, glcontext)) {
+                        gl_free_frame (coverflow);
+                        if (priv->thumb_covers && thumb_bytes > retained)
+                                gl_free_thumbs (coverflow);
+                        if (priv->thumb_covers)
+                                retained -= thumb_bytes;
+                        if (priv->covers && cover_bytes > retained)
+                                gl_free_covers (coverflow);
+                        if (priv->covers)
+                                retained -= cover_bytes;
+                        gdk_gl_drawable_gl_end (gldrawable);
+                }
+        }
+
+        ario_coverflow_cache_trim (priv->cache, retained);
+        ARIO_LOG_DBG ("Released resources, cover textures %s, thumbnails %s",
+                      priv->covers ? "kept" : "freed",
+                      priv->thumb_covers ? "kept" : "freed");
+}
+
+static void
+load_texture (ArioCoverflow *coverflow,
+              int slot,
+              ArioCoverflowAlbum *album)
+{
+        ArioCoverflowPrivate *priv = coverflow->priv;
+        const gchar *key = album->key;
+
+        if (priv->slot_keys[slot] == key)
+                return;
+
+        /* The slot shows the placeholder until the cover is uploaded */
+        priv->slot_keys[slot] = key;
+        priv->slot_loaded[slot] = FALSE;
+
+        /* Prefetched covers are uploaded by upload_slots */
+        if (g_hash_table_lookup_extended (priv->decoded, key, NULL, NULL)) {
+                ario_coverflow_stats_count (ARIO_COVERFLOW_STATS_PREFETCH_HITS, 1);
+                return;
+        }
+        ario_coverflow_stats_count (ARIO_COVERFLOW_STATS_PREFETCH_MISSES, 1);
+
+        ARIO_LOG_DBG ("Loading texture for: %s - %s", album->artist, album->album);
+        request_cover (coverflow, album, key, 0);
+}
+
+static void
+request_cover (ArioCoverflow *coverflow,
+               ArioCoverflowAlbum *album,
+               const gchar *key,
+               gint priority)
+{
+        ArioCoverflowPrivate *priv = coverflow->priv;
+        ArioCoverflowImage *image = NULL;
+        const gchar *cover_path;
+        gint64 mtime;
+        goffset size;
+        gint64 start = ario_coverflow_stats_now ();
+
+        /* An empty file, like a failed download, is no cover either */
+        cover_path = ario_coverflow_paths_lookup (priv->paths, key, album->artist, album->album,
+                                                  &mtime, &size);
+        ario_coverflow_stats_time (ARIO_COVERFLOW_STATS_PATH, start);
+        set_cover_mtime (coverflow, key, cover_path ? mtime : 0);
+        if (cover_path == NULL || size == 0) {
+                g_hash_table_insert (priv->decoded, (gpointer) key, NULL);
+                return;
+        }
+
+        /* Neither does a cover decoded earlier in the session, or a
+         * pack record made from this very file */
+        image = ario_coverflow_cache_lookup (priv->cache, key, mtime);
+        if (image) {
+                g_hash_table_insert (priv->decoded, (gpointer) key, image);
+                return;
+        }
+        if (priv->pack)
+                image = ario_coverflow_pack_lookup (priv->pack, key, mtime, priv->cover_size);
+        if (image) {
+                ario_coverflow_stats_count (ARIO_COVERFLOW_STATS_PACK_HITS, 1);
+                g_hash_table_insert (priv->decoded, (gpointer) key, image);
+        } else {
+                ario_coverflow_stats_count (ARIO_COVERFLOW_STATS_PACK_MISSES, 1);
+                ario_coverflow_loader_request (priv->loader, key, cover_path,
+                                               mtime, priority);
+        }
+}
+
+static void
+texture_loaded (const gchar *key,
+                gint64 mtime,
+                ArioCoverflowImage *image,
+                gpointer data)
+{
+        ArioCoverflow *coverflow = (ArioCoverflow *) data;
+
+        if (image == NULL)
                 ARIO_LOG_DBG ("No cover !");
-                glTexImage2D (GL_TEXTURE_2D, 0, GL_RGB, 0, 0, 0,
-                              GL_RGB, GL_UNSIGNED_BYTE, NULL);
+
+        /* Covers we moved away from are dropped by the next prefetch.
+         * The mtime they were requested with may be gone already */
+        set_cover_mtime (coverflow, key, mtime);
+        g_hash_table_insert (coverflow->priv->decoded, (gpointer) key,
+                             image ? ario_coverflow_image_ref (image) : NULL);
+        upload_slots (coverflow);
+}
+
+/* Uploads the decoded covers of the slots, the GL context must be
+ * current. Returns whether any was uploaded */
+static gboolean
+upload_pending (ArioCoverflow *coverflow)
+{
+        ArioCoverflowPrivate *priv = coverflow->priv;
+        ArioCoverflowImage *image;
+        gboolean uploaded = FALSE;
+        gint64 start;
+        int i;
+
+        /* Thumbnails are small enough to go straight from client
+         * memory */
+        for (i = 0; i < N_COVERS; i++) {
+                image = priv->thumb_images[i];
+                if (image == NULL)
+                        continue;
+                upload_thumb (coverflow, i, image);
+                ario_coverflow_image_unref (image);
+                priv->thumb_images[i] = NULL;
+                priv->thumb_loaded[i] = TRUE;
+                uploaded = TRUE;
+        }
+
+        /* The view may have moved while the cover was decoded */
+        priv->upload_deferred = FALSE;
+        for (i = 0; i < N_COVERS; i++) {
+                if (priv->slot_keys[i] == NULL || priv->slot_loaded[i])
+                        continue;
+
+                image = g_hash_table_lookup (priv->decoded, priv->slot_keys[i]);
+                if (image == NULL)
+                        continue;
+                start = ario_coverflow_stats_now ();
+                if (!upload_texture (coverflow, i, image)) {
+                        ario_coverflow_stats_count (ARIO_COVERFLOW_STATS_DEFERRED_UPLOADS, 1);
+                        priv->upload_deferred = TRUE;
+                        break;
+                }
+                ario_coverflow_stats_time (ARIO_COVERFLOW_STATS_UPLOAD, start);
+                priv->slot_loaded[i] = TRUE;
+                uploaded = TRUE;
         }
 
-        g_free (cover_path);
+        return uploaded;
+}
+
+static void
+upload_slots (ArioCoverflow *coverflow)
+{
+        ArioCoverflowPrivate *priv = coverflow->priv;
+        GdkGLContext *glcontext;
+        GdkGLDrawable *gldrawable;
+        gboolean uploaded;
+
+        /* Nowhere to upload to while the textures are released */
+        if (!gtk_widget_get_realized (priv->drawing_area) || priv->covers == 0)
+                return;
+
+        glcontext = gtk_widget_get_gl_context (priv->drawing_area);
+        gldrawable = gtk_widget_get_gl_drawable (priv->drawing_area);
+        if (!gdk_gl_drawable_gl_begin (gldrawable, glcontext))
+                return;
+
+        uploaded = upload_pending (coverflow);
+
+        gdk_gl_drawable_gl_end (gldrawable);
+        if (uploaded || priv->upload_deferred)
+                queue_redraw (coverflow);
+}
+
+/* Fills one level of a slot layer or atlas cell, of the covers or the
+ * thumbnails texture as bound */
+static void
+upload_layer (ArioCoverflow *coverflow,
+              gint cover_size,
+              int layer,
+              int level,
+              const guchar *pixels)
+{
+        GLsizei size = ario_coverflow_image_level_size (cover_size, level);
+
+        if (coverflow->priv->instanced)
+                glTexSubImage3D (GL_TEXTURE_2D_ARRAY, level, 0, 0, layer,
+                                 size, size, 1, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, pixels);
+        else
+                glTexSubImage2D (GL_TEXTURE_2D, level,
+                                 (layer % ATLAS_COLUMNS) * size,
+                                 (layer / ATLAS_COLUMNS) * size,
+                                 size, size, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, pixels);
+}
+
+/* Returns FALSE when the upload ring is full, the cover is then to be
+ * uploaded later */
+static gboolean
+upload_texture (ArioCoverflow *coverflow,
+                int slot,
+                ArioCoverflowImage *image)
+{
+        ArioCoverflowPrivate *priv = coverflow->priv;
+        GLsync *fence;
+        gsize offset;
+        int level;
+
+        g_return_val_if_fail (image->size == priv->cover_size, TRUE);
+
+        glBindTexture (priv->instanced ? GL_TEXTURE_2D_ARRAY : GL_TEXTURE_2D,
+                       priv->covers);
+
+        /* Images hold their whole mip chain, in the upload format: rows
+         * of 4 byte pixels need no unpacking */
+        if (priv->upload_map == NULL) {
+                for (level = 0; level < image->n_levels; level++) {
+                        upload_layer (coverflow, image->size, slot, level,
+                                      image->pixels + ario_coverflow_image_level_offset (image->size, level));
+                }
+                priv->bytes_uploaded += image->length;
+                return TRUE;
+        }
+
+        /* Never wait for the GPU to release a region */
+        fence = &priv->upload_fences[priv->upload_next];
+        if (*fence) {
+                if (glClientWaitSync (*fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+                        return FALSE;
+                glDeleteSync (*fence);
+                *fence = NULL;
+        }
+
+        /* The copy returns as soon as the data is in the buffer, the
+         * transfer to the texture then runs asynchronously */
+        offset = priv->upload_next * priv->upload_region_size;
+        memcpy (priv->upload_map + offset, image->pixels, image->length);
+        glBindBuffer (GL_PIXEL_UNPACK_BUFFER, priv->upload_buffer);
+        for (level = 0; level < image->n_levels; level++) {
+                upload_layer (coverflow, image->size, slot, level,
+                              GSIZE_TO_POINTER (offset + ario_coverflow_image_level_offset (image->size, level)));
+        }
+        glBindBuffer (GL_PIXEL_UNPACK_BUFFER, 0);
+        *fence = glFenceSync (GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        priv->upload_next = (priv->upload_next + 1) % UPLOAD_REGIONS;
+        priv->bytes_uploaded += image->length;
+
+        return TRUE;
+}
+
+static void
+upload_thumb (ArioCoverflow *coverflow,
+              int slot,
+              ArioCoverflowImage *image)
+{
+        int level;
+
+        g_return_if_fail (image->size == THUMB_SIZE);
+
+        glBindTexture (coverflow->priv->instanced ? GL_TEXTURE_2D_ARRAY : GL_TEXTURE_2D,
+                       coverflow->priv->thumb_covers);
+        for (level = 0; level < image->n_levels; level++) {
+                upload_layer (coverflow, THUMB_SIZE, slot, level,
+                              image->pixels + ario_coverflow_image_level_offset (THUMB_SIZE, level));
+        }
 }
 
 static void
@@ -650,71 +2488,457 @@ gl_init_lights(void)
         glEnable (GL_DEPTH_TEST);
 }
 
+/* Slot layers of the given size, with their mip levels, and the
+ * placeholder: an array texture, or an atlas in the fixed pipeline */
+static GLuint
+gl_new_layers (ArioCoverflow *coverflow,
+               gint cover_size)
+{
+        ArioCoverflowPrivate *priv = coverflow->priv;
+        GLenum target = priv->instanced ? GL_TEXTURE_2D_ARRAY : GL_TEXTURE_2D;
+        gint n_levels = ario_coverflow_image_n_levels (cover_size);
+        GLfloat anisotropy;
+        GLsizei size;
+        GLuint texture;
+        guchar *placeholder, *pixel;
+        int level, x, y;
+
+        glGenTextures (1, &texture);
+        glBindTexture (target, texture);
+        glTexParameteri (target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri (target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri (target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri (target, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri (target, GL_TEXTURE_MAX_LEVEL, n_levels - 1);
+
+        /* Keeps the rotated side covers sharp along their short axis */
+        if (GLEW_EXT_texture_filter_anisotropic) {
+                glGetFloatv (GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &anisotropy);
+                glTexParameterf (target, GL_TEXTURE_MAX_ANISOTROPY_EXT,
+                                 MIN (anisotropy, MAX_ANISOTROPY));
+        }
+
+        /* Every slot is allocated once, covers are then only replaced.
+         * Immutable storage spares the driver from checking the
+         * texture for completeness at each upload */
+        if (GLEW_ARB_texture_storage) {
+                if (priv->instanced)
+                        glTexStorage3D (GL_TEXTURE_2D_ARRAY, n_levels, GL_RGBA8,
+                                        cover_size, cover_size, N_LAYERS);
+                else
+                        glTexStorage2D (GL_TEXTURE_2D, n_levels, GL_RGBA8,
+                                        cover_size * ATLAS_COLUMNS,
+                                        cover_size * ATLAS_ROWS);
+        } else {
+                for (level = 0; level < n_levels; level++) {
+                        size = ario_coverflow_image_level_size (cover_size, level);
+                        if (priv->instanced)
+                                glTexImage3D (GL_TEXTURE_2D_ARRAY, level, GL_RGBA8, size, size,
+                                              N_LAYERS, 0, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, NULL);
+                        else
+                                glTexImage2D (GL_TEXTURE_2D, level, GL_RGBA8,
+                                              size * ATLAS_COLUMNS, size * ATLAS_ROWS,
+                                              0, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, NULL);
+                }
+        }
+
+        /* Shown in the slots whose cover is still being decoded: a 2x2
+         * checker, drawn at each level */
+        placeholder = g_malloc (cover_size * cover_size * ARIO_COVERFLOW_IMAGE_CHANNELS);
+        for (level = 0; level < n_levels; level++) {
+                size = ario_coverflow_image_level_size (cover_size, level);
+                pixel = placeholder;
+                for (y = 0; y < size; y++) {
+                        for (x = 0; x < size; x++) {
+                                memset (pixel, ((x < size / 2) == (y < size / 2)) ? 0x40 : 0x30, 3);
+                                pixel[3] = 0xff;
+                                pixel += ARIO_COVERFLOW_IMAGE_CHANNELS;
+                        }
+                }
+                upload_layer (coverflow, cover_size, PLACEHOLDER_LAYER, level, placeholder);
+        }
+        g_free (placeholder);
+
+        return texture;
+}
+
+static gsize
+gl_layers_length (gint cover_size)
+{
+        return N_LAYERS * ario_coverflow_image_length (cover_size,
+                                                       ario_coverflow_image_n_levels (cover_size));
+}
+
+static void
+gl_set_texture_stats (ArioCoverflow *coverflow)
+{
+        ArioCoverflowPrivate *priv = coverflow->priv;
+
+        ario_coverflow_stats_set (ARIO_COVERFLOW_STATS_TEXTURE_BYTES,
+                                  (priv->covers ? gl_layers_length (priv->cover_size) : 0)
+                                  + (priv->thumb_covers ? gl_layers_length (THUMB_SIZE) : 0));
+}
+
+/* Makes the textures release_resources freed, or all of them */
 static void
 gl_init_textures (ArioCoverflow *coverflow)
 {
+        ArioCoverflowPrivate *priv = coverflow->priv;
+
+        if (priv->covers == 0)
+                priv->covers = gl_new_layers (coverflow, priv->cover_size);
+        if (priv->thumb_covers == 0)
+                priv->thumb_covers = gl_new_layers (coverflow, THUMB_SIZE);
+        gl_set_texture_stats (coverflow);
+
+        if (!priv->instanced) {
+                glEnable (GL_TEXTURE_2D);
+                glTexEnvf (GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+        }
+}
+
+static void
+gl_init_upload_ring (ArioCoverflow *coverflow)
+{
+        ArioCoverflowPrivate *priv = coverflow->priv;
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+        /* Without it covers are uploaded from client memory */
+        if (!GLEW_ARB_buffer_storage || !GLEW_ARB_sync) {
+                ARIO_LOG_DBG ("No persistent buffer mapping, uploading synchronously");
+                return;
+        }
+
+        priv->upload_region_size = ario_coverflow_image_length (priv->cover_size,
+                                                                ario_coverflow_image_n_levels (priv->cover_size));
+        glGenBuffers (1, &priv->upload_buffer);
+        glBindBuffer (GL_PIXEL_UNPACK_BUFFER, priv->upload_buffer);
+        glBufferStorage (GL_PIXEL_UNPACK_BUFFER, UPLOAD_REGIONS * priv->upload_region_size,
+                         NULL, flags);
+        priv->upload_map = glMapBufferRange (GL_PIXEL_UNPACK_BUFFER, 0,
+                                             UPLOAD_REGIONS * priv->upload_region_size,
+                                             flags);
+        glBindBuffer (GL_PIXEL_UNPACK_BUFFER, 0);
+        ario_coverflow_stats_set (ARIO_COVERFLOW_STATS_BUFFER_BYTES,
+                                  UPLOAD_REGIONS * priv->upload_region_size);
+}
+
+/* The frame cache follows the size of the window. Without framebuffer
+ * objects, or if the driver refuses these formats, every expose draws
+ * the scene */
+static void
+gl_resize_frame (ArioCoverflow *coverflow,
+                 gint width,
+                 gint height)
+{
+        ArioCoverflowPrivate *priv = coverflow->priv;
+
+        priv->frame_valid = FALSE;
+        if (!GLEW_VERSION_3_0 && !GLEW_ARB_framebuffer_object)
+                return;
+        if (priv->frame_fbo && width == priv->frame_width && height == priv->frame_height)
+                return;
+
+        if (priv->frame_fbo == 0) {
+                glGenFramebuffers (1, &priv->frame_fbo);
+                glGenRenderbuffers (2, priv->frame_renderbuffers);
+        }
+        glBindRenderbuffer (GL_RENDERBUFFER, priv->frame_renderbuffers[0]);
+        glRenderbufferStorage (GL_RENDERBUFFER, GL_RGBA8, width, height);
+        glBindRenderbuffer (GL_RENDERBUFFER, priv->frame_renderbuffers[1]);
+        glRenderbufferStorage (GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+        glBindRenderbuffer (GL_RENDERBUFFER, 0);
+
+        glBindFramebuffer (GL_FRAMEBUFFER, priv->frame_fbo);
+        glFramebufferRenderbuffer (GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                                   GL_RENDERBUFFER, priv->frame_renderbuffers[0]);
+        glFramebufferRenderbuffer (GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                                   GL_RENDERBUFFER, priv->frame_renderbuffers[1]);
+        if (glCheckFramebufferStatus (GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+                ARIO_LOG_DBG ("Incomplete frame buffer, frames are not cached");
+                glBindFramebuffer (GL_FRAMEBUFFER, 0);
+                glDeleteFramebuffers (1, &priv->frame_fbo);
+                glDeleteRenderbuffers (2, priv->frame_renderbuffers);
+                priv->frame_fbo = 0;
+                return;
+        }
+        glBindFramebuffer (GL_FRAMEBUFFER, 0);
+
+        priv->frame_width = width;
+        priv->frame_height = height;
+        ario_coverflow_stats_set (ARIO_COVERFLOW_STATS_BUFFER_BYTES,
+                                  UPLOAD_REGIONS * priv->upload_region_size
+                                  + (gsize) width * height * 8);
+}
+
+/* The slots of a freed texture load their cover again */
+static void
+gl_free_covers (ArioCoverflow *coverflow)
+{
+        ArioCoverflowPrivate *priv = coverflow->priv;
         int i;
-        glEnable (GL_TEXTURE_2D);
 
-        glGenTextures(N_COVERS, coverflow->priv->textures);
+        glDeleteTextures (1, &priv->covers);
+        priv->covers = 0;
         for (i = 0; i < N_COVERS; i++) {
-                glBindTexture(GL_TEXTURE_2D, coverflow->priv->textures[i]);
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-                glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-                glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-                glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-                glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+                priv->slot_keys[i] = NULL;
+                priv->slot_loaded[i] = FALSE;
+        }
+        gl_set_texture_stats (coverflow);
+}
+
+static void
+gl_free_thumbs (ArioCoverflow *coverflow)
+{
+        ArioCoverflowPrivate *priv = coverflow->priv;
+        int i;
+
+        glDeleteTextures (1, &priv->thumb_covers);
+        priv->thumb_covers = 0;
+        for (i = 0; i < N_COVERS; i++) {
+                priv->thumb_keys[i] = NULL;
+                priv->thumb_loaded[i] = FALSE;
+        }
+        gl_set_texture_stats (coverflow);
+}
+
+static void
+gl_free_frame (ArioCoverflow *coverflow)
+{
+        ArioCoverflowPrivate *priv = coverflow->priv;
+
+        priv->frame_valid = FALSE;
+        if (priv->frame_fbo == 0)
+                return;
+
+        glDeleteFramebuffers (1, &priv->frame_fbo);
+        glDeleteRenderbuffers (2, priv->frame_renderbuffers);
+        priv->frame_fbo = 0;
+        ario_coverflow_stats_set (ARIO_COVERFLOW_STATS_BUFFER_BYTES,
+                                  UPLOAD_REGIONS * priv->upload_region_size);
+}
+
+/* Where the linked program is kept for the next start, NULL when the
+ * driver can't give it. Any change of driver, variant or source makes
+ * another file */
+static gchar *
+shader_cache_filename (const gchar *defines)
+{
+        gchar *key, *checksum, *dirname, *filename;
+
+        if (!GLEW_ARB_get_program_binary)
+                return NULL;
+
+        key = g_strjoin ("\n", (const gchar *) glGetString (GL_VENDOR),
+                         (const gchar *) glGetString (GL_RENDERER),
+                         (const gchar *) glGetString (GL_VERSION),
+                         defines, shader_vert, shader_frag, NULL);
+        checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA1, key, -1);
+        g_free (key);
+
+        dirname = g_build_filename (ario_util_config_dir (), "coverflow-shaders", NULL);
+        g_mkdir_with_parents (dirname, 0700);
+        filename = g_build_filename (dirname, checksum, NULL);
+        g_free (dirname);
+        g_free (checksum);
+
+        return filename;
+}
+
+static gboolean
+load_program_binary (GLuint program,
+                     const gchar *filename)
+{
+        gchar *contents;
+        gsize length;
+        guint32 header[2];
+        GLint status = GL_FALSE;
+
+        if (filename == NULL
+            || !g_file_get_contents (filename, &contents, &length, NULL))
+                return FALSE;
+
+        /* The driver may refuse a binary it made, after an update */
+        if (length > sizeof (header)) {
+                memcpy (header, contents, sizeof (header));
+                if (header[0] == SHADER_CACHE_MAGIC) {
+                        glProgramBinary (program, header[1], contents + sizeof (header),
+                                         length - sizeof (header));
+                        glGetProgramiv (program, GL_LINK_STATUS, &status);
+                }
         }
+        g_free (contents);
+
+        ARIO_LOG_DBG ("Shader program %s from %s",
+                      status == GL_TRUE ? "loaded" : "not loaded", filename);
+        return status == GL_TRUE;
 }
 
-#ifdef ARIO_COVERFLOW_USE_SHADERS
 static void
+save_program_binary (GLuint program,
+                     const gchar *filename)
+{
+        gchar *contents;
+        GLint length = 0;
+        GLenum format;
+        guint32 header[2];
+
+        if (filename == NULL)
+                return;
+
+        glGetProgramiv (program, GL_PROGRAM_BINARY_LENGTH, &length);
+        if (length <= 0)
+                return;
+
+        contents = g_malloc (sizeof (header) + length);
+        glGetProgramBinary (program, length, NULL, &format, contents + sizeof (header));
+        header[0] = SHADER_CACHE_MAGIC;
+        header[1] = format;
+        memcpy (contents, header, sizeof (header));
+        if (!g_file_set_contents (filename, contents, sizeof (header) + length, NULL))
+                ARIO_LOG_DBG ("Can't write %s", filename);
+        g_free (contents);
+}
+
+static gboolean
 gl_init_shaders (ArioCoverflow *coverflow)
 {
-        coverflow->priv->vshader = load_shader (GL_VERTEX_SHADER, "shader.vert");
-        coverflow->priv->fshader = load_shader (GL_FRAGMENT_SHADER, "shader.frag");
-        coverflow->priv->program = glCreateProgram ();
-        if (coverflow->priv->program == INVALID_PROGRAM) {
-                coverflow->priv->shader_initialized = FALSE;
+        ArioCoverflowPrivate *priv = coverflow->priv;
+        GLint status = GL_FALSE;
+        GString *defines;
+        gchar *cache_filename;
+        gboolean ret = FALSE;
+
+        /* Variants of the shaders, as defines after the #version */
+        defines = g_string_new (NULL);
+        if (SIDE_LOD_BIAS > 0)
+                g_string_append (defines, "#define LOD_BIAS\n");
+
+        priv->program = glCreateProgram ();
+        if (priv->program == INVALID_PROGRAM) {
                 ARIO_LOG_DBG ("Cant create shader program");
-                return;
+                g_string_free (defines, TRUE);
+                return FALSE;
+        }
+
+        /* Compiling is only needed when the cache can't be used */
+        cache_filename = shader_cache_filename (defines->str);
+        if (load_program_binary (priv->program, cache_filename)) {
+                ret = TRUE;
+        } else {
+                priv->vshader = load_shader (GL_VERTEX_SHADER, shader_vert, defines->str);
+                priv->fshader = load_shader (GL_FRAGMENT_SHADER, shader_frag, defines->str);
+                if (priv->vshader != INVALID_SHADER && priv->fshader != INVALID_SHADER) {
+                        glAttachShader (priv->program, priv->vshader);
+                        glAttachShader (priv->program, priv->fshader);
+                        if (cache_filename)
+                                glProgramParameteri (priv->program,
+                                                     GL_PROGRAM_BINARY_RETRIEVABLE_HINT,
+                                                     GL_TRUE);
+                        glLinkProgram (priv->program);
+                        glGetProgramiv (priv->program, GL_LINK_STATUS, &status);
+                        if (status == GL_TRUE) {
+                                save_program_binary (priv->program, cache_filename);
+                                ret = TRUE;
+                        } else {
+                                ARIO_LOG_DBG ("Can't link shader program");
+                        }
+                }
         }
-        if (coverflow->priv->vshader != INVALID_SHADER)
-                glAttachShader (coverflow->priv->program, coverflow->priv->vshader);
-        if (coverflow->priv->fshader != INVALID_SHADER)
-                glAttachShader (coverflow->priv->program, coverflow->priv->fshader);
-        glLinkProgram (coverflow->priv->program);
-        glUseProgram (coverflow->priv->program);
-        coverflow->priv->shader_initialized = TRUE;
+        g_free (cache_filename);
+        g_string_free (defines, TRUE);
+        if (!ret)
+                return FALSE;
+
+        glUseProgram (priv->program);
+        glUniform1i (glGetUniformLocation (priv->program, "covers"), 0);
+        priv->view_projection_location = glGetUniformLocation (priv->program, "view_projection");
+        glUseProgram (0);
+
+        priv->shader_initialized = TRUE;
+        return TRUE;
 }
 
+static void
+gl_init_buffers (ArioCoverflow *coverflow)
+{
+        ArioCoverflowPrivate *priv = coverflow->priv;
+        int i;
+
+        glGenVertexArrays (1, &priv->vertex_array);
+        glBindVertexArray (priv->vertex_array);
+
+        /* The quad never changes */
+        glGenBuffers (1, &priv->quad_buffer);
+        glBindBuffer (GL_ARRAY_BUFFER, priv->quad_buffer);
+        glBufferData (GL_ARRAY_BUFFER, sizeof (quad), quad, GL_STATIC_DRAW);
+        glEnableVertexAttribArray (ATTRIB_POSITION);
+        glVertexAttribPointer (ATTRIB_POSITION, 2, GL_FLOAT, GL_FALSE,
+                               sizeof (quad[0]), (GLvoid *) 0);
+        glEnableVertexAttribArray (ATTRIB_TEXCOORD);
+        glVertexAttribPointer (ATTRIB_TEXCOORD, 2, GL_FLOAT, GL_FALSE,
+                               sizeof (quad[0]), (GLvoid *) (2 * sizeof (GLfloat)));
+
+        /* One CoverInstance per cover, refilled each frame */
+        glGenBuffers (1, &priv->instance_buffer);
+        glBindBuffer (GL_ARRAY_BUFFER, priv->instance_buffer);
+        glBufferData (GL_ARRAY_BUFFER, N_COVERS * sizeof (CoverInstance), NULL, GL_STREAM_DRAW);
+        for (i = 0; i < 4; i++) {
+                glEnableVertexAttribArray (ATTRIB_MODEL + i);
+                glVertexAttribPointer (ATTRIB_MODEL + i, 4, GL_FLOAT, GL_FALSE,
+                                       sizeof (CoverInstance),
+                                       (GLvoid *) (G_STRUCT_OFFSET (CoverInstance, model)
+                                                   + 4 * i * sizeof (GLfloat)));
+                glVertexAttribDivisor (ATTRIB_MODEL + i, 1);
+        }
+        glEnableVertexAttribArray (ATTRIB_LAYER);
+        glVertexAttribPointer (ATTRIB_LAYER, 1, GL_FLOAT, GL_FALSE,
+                               sizeof (CoverInstance),
+                               (GLvoid *) G_STRUCT_OFFSET (CoverInstance, layer));
+        glVertexAttribDivisor (ATTRIB_LAYER, 1);
+        glEnableVertexAttribArray (ATTRIB_LOD_BIAS);
+        glVertexAttribPointer (ATTRIB_LOD_BIAS, 1, GL_FLOAT, GL_FALSE,
+                               sizeof (CoverInstance),
+                               (GLvoid *) G_STRUCT_OFFSET (CoverInstance, lod_bias));
+        glVertexAttribDivisor (ATTRIB_LOD_BIAS, 1);
+
+        glBindVertexArray (0);
+        glBindBuffer (GL_ARRAY_BUFFER, 0);
+}
+
+/* The defines go right after the #version line, which must come
+ * first */
 static GLuint
-load_shader (GLenum shader_type, gchar *filename)
+load_shader (GLenum shader_type,
+             const gchar *source,
+             const gchar *defines)
 {
-        gchar *contents;
+        const gchar *body;
+        const GLchar *strings[3];
+        GLint lengths[3];
         GLint status = GL_TRUE;
         GLuint shader = glCreateShader (shader_type);
         if (shader == INVALID_SHADER) {
-                ARIO_LOG_DBG ("Can't create shader: %s", filename);
+                ARIO_LOG_DBG ("Can't create shader %x", shader_type);
                 return INVALID_SHADER;
         }
 
-        gboolean success = g_file_get_contents (filename, &contents, NULL, NULL);
-        if (success == FALSE) {
-                ARIO_LOG_DBG ("Can't load shader: %s", filename);
-                return INVALID_SHADER;
-        }
-
-        glShaderSource (shader, 1, (const GLchar **) &contents, NULL);
-        g_free (contents);
+        body = strchr (source, '\n');
+        body = body ? body + 1 : source + strlen (source);
+        strings[0] = source;
+        lengths[0] = body - source;
+        strings[1] = defines;
+        lengths[1] = -1;
+        strings[2] = body;
+        lengths[2] = -1;
+        glShaderSource (shader, 3, strings, lengths);
 
         glCompileShader (shader);
         glGetShaderiv (shader, GL_COMPILE_STATUS, &status);
         if (status != GL_TRUE) {
-                ARIO_LOG_DBG ("Can't compile shader: %s", filename);
+                ARIO_LOG_DBG ("Can't compile shader %x", shader_type);
                 return INVALID_SHADER;
         }
 
         return shader;
 }
-#endif
@@ -0,0 +1,33 @@
+dnl  Copyright (C) 2011 - Quentin Stievenart <quentin.stievenart@gmail.com>
+dnl
+dnl  This program is free software; you can redistribute it and/or modify
+dnl  it under the terms of the GNU General Public License as published by
+dnl  the Free Software Foundation; either version 2, or (at your option)
+dnl  any later version.
+dnl
+dnl  Configure checks of the coverflow plugin, the same ones SConstruct
+dnl  does. Called from the configure.ac of Ario, after its own checks:
+dnl
+dnl    m4_include([plugins/coverflow/coverflow.m4])
+dnl    ARIO_COVERFLOW_CHECKS
+
+AC_DEFUN([ARIO_COVERFLOW_CHECKS],
+[
+dnl LZ4 is optional, to keep the cover cache compressed
+PKG_CHECK_MODULES([LZ4], [liblz4],
+                  [AC_DEFINE([HAVE_LZ4], [1], [Define to compress the coverflow cover cache with LZ4])],
+                  [AC_MSG_NOTICE([liblz4 not found, cached covers are kept uncompressed])])
+
+dnl Without libjpeg, JPEG covers go through gdk-pixbuf
+PKG_CHECK_MODULES([JPEG], [libjpeg],
+                  [AC_DEFINE([HAVE_LIBJPEG], [1], [Define to decode JPEG covers with libjpeg at a reduced scale])],
+                  [AC_MSG_NOTICE([libjpeg not found, JPEG covers are decoded by gdk-pixbuf])])
+
+dnl The headless benchmark renders with OSMesa, "make bench" says so
+dnl when it is disabled
+PKG_CHECK_MODULES([BENCH], [osmesa glew glu glut],
+                  [have_coverflow_bench=yes],
+                  [have_coverflow_bench=no
+                   AC_MSG_NOTICE([OSMesa, GLEW, GLU or GLUT not found, the coverflow benchmark is disabled])])
+AM_CONDITIONAL([HAVE_COVERFLOW_BENCH], [test "x$have_coverflow_bench" = xyes])
+])
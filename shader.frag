@@ -1,7 +1,20 @@
-uniform sampler2D tex;
+#version 330
+
+/* One layer per texture slot, the last one is the placeholder */
+uniform sampler2DArray covers;
+
+in vec3 uv;
+#ifdef LOD_BIAS
+flat in float bias;
+#endif
+
+out vec4 color;
 
 void main()
 {
-    vec4 color = texture2D(tex,gl_TexCoord[0].st);
-    gl_FragColor = color;
+#ifdef LOD_BIAS
+  color = texture(covers, uv, bias);
+#else
+  color = texture(covers, uv);
+#endif
 }
@@ -1,5 +1,25 @@
+#version 330
+
+uniform mat4 view_projection;
+
+layout(location = 0) in vec2 position;
+layout(location = 1) in vec2 texcoord;
+
+/* Per cover */
+layout(location = 2) in mat4 model;
+layout(location = 6) in float layer;
+layout(location = 7) in float lod_bias;
+
+out vec3 uv;
+#ifdef LOD_BIAS
+flat out float bias;
+#endif
+
 void main()
 {
-  gl_TexCoord[0] = gl_MultiTexCoord0;
-  gl_Position = ftransform();
+  uv = vec3(texcoord, layer);
+#ifdef LOD_BIAS
+  bias = lod_bias;
+#endif
+  gl_Position = view_projection * model * vec4(position, 0.0, 1.0);
 }